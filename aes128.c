@@ -17,8 +17,14 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#include <stddef.h>
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+  #include <wmmintrin.h>
+  #define AES128_AESNI
+#endif
+
 #include "aes.h"
 #include "aes128.h"
 
@@ -47,3 +53,75 @@ extern void aes128_key_init(aes128_key_t* key) {
     // Use the previous round's key to incrementally advance the key
     aes128_key_advance(key->val + (i << 4), key->val + (j << 4), j);
 }
+
+#ifdef AES128_AESNI
+/**
+ * Advances four interleaved key schedules by one round using AES-NI.
+ *
+ * @param  k     The previous round key of each schedule (updated in place).
+ * @param  out   The four key schedules being expanded.
+ * @param  i     The index of the round key being produced.
+ * @param  rcon  The round constant (must be an immediate).
+ */
+#define AES128_KEY_ROUND(k, out, i, rcon)                                  \
+  for (int j = 0; j < 4; ++j) {                                            \
+    __m128i t = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k[j], rcon),   \
+      0xFF);                                                               \
+    k[j] = _mm_xor_si128(k[j], _mm_slli_si128(k[j], 4));                   \
+    k[j] = _mm_xor_si128(k[j], _mm_slli_si128(k[j], 4));                   \
+    k[j] = _mm_xor_si128(k[j], _mm_slli_si128(k[j], 4));                   \
+    k[j] = _mm_xor_si128(k[j], t);                                         \
+    _mm_storeu_si128((__m128i*)(out[j].val + ((i) << 4)), k[j]);           \
+  }
+
+/**
+ * Expands four key schedules at once using the AESKEYGENASSIST instruction.
+ *
+ * The four schedules are interleaved so that the latency of each instruction
+ * is hidden behind the work on the other keys.
+ *
+ * @param  keys  The four keys to be expanded in place.
+ */
+__attribute__((target("aes,sse2")))
+void aes128_key_init_aesni(aes128_key_t* keys) {
+  __m128i k[4];
+  for (int j = 0; j < 4; ++j)
+    k[j] = _mm_loadu_si128((const __m128i*)keys[j].val);
+  AES128_KEY_ROUND(k, keys,  1, 0x01)
+  AES128_KEY_ROUND(k, keys,  2, 0x02)
+  AES128_KEY_ROUND(k, keys,  3, 0x04)
+  AES128_KEY_ROUND(k, keys,  4, 0x08)
+  AES128_KEY_ROUND(k, keys,  5, 0x10)
+  AES128_KEY_ROUND(k, keys,  6, 0x20)
+  AES128_KEY_ROUND(k, keys,  7, 0x40)
+  AES128_KEY_ROUND(k, keys,  8, 0x80)
+  AES128_KEY_ROUND(k, keys,  9, 0x1B)
+  AES128_KEY_ROUND(k, keys, 10, 0x36)
+  // Zero-initialize the working keys for security
+  for (int j = 0; j < 4; ++j) k[j] = _mm_setzero_si128();
+}
+#endif
+
+/**
+ * Zeroes a buffer holding key material in a way that the compiler can't
+ * remove, even when the buffer is never read (or is freed) afterwards.
+ *
+ * @param  ptr     The buffer to be wiped.
+ * @param  length  The length of the buffer in bytes.
+ */
+void aes128_wipe(void* ptr, size_t length) {
+  volatile unsigned char* bytes = (volatile unsigned char*)ptr;
+  while (length-- > 0) *bytes++ = 0;
+}
+
+extern void aes128_key_init_bulk(aes128_key_t* keys, size_t count) {
+  #ifdef AES128_AESNI
+  // Expand groups of four keys with AES-NI when the CPU supports it
+  if (__builtin_cpu_supports("aes"))
+    for (; count >= 4; count -= 4, keys += 4)
+      aes128_key_init_aesni(keys);
+  #endif
+  // Expand any remaining keys one at a time
+  for (; count > 0; --count, ++keys)
+    aes128_key_init(keys);
+}
@@ -20,6 +20,8 @@
 #ifndef __AES128_H
 #define __AES128_H
 
+#include <stddef.h>
+
 #include "aes.h"
 
 typedef struct {
@@ -36,4 +38,8 @@ typedef struct {
 
 extern void aes128_key_init(aes128_key_t* key);
 
+extern void aes128_key_init_bulk(aes128_key_t* keys, size_t count);
+
+extern void aes128_wipe(void* ptr, size_t length);
+
 #endif
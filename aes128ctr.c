@@ -17,8 +17,12 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #ifdef __APPLE__
   #include <OpenCL/opencl.h>
@@ -28,6 +32,7 @@
 
 #include "aes128.h"
 #include "aes128ctr.h"
+#include "staging.h"
 
 #define MIN(a,b) (a < b ? a : b)
 
@@ -35,6 +40,28 @@ const char DCPU32[] = "aes128ctr.cpu32.bc";
 const char DCPU64[] = "aes128ctr.cpu64.bc";
 const char DGPU32[] = "aes128ctr.gpu32.bc";
 const char DGPU64[] = "aes128ctr.gpu64.bc";
+const char DSOURCE[] = "aes128ctr.cl";
+
+/**
+ * An in-memory cache of key-specialized program binaries (see
+ * `aes128ctr_create_jit_program()`), keyed by device, key and nonce.
+ */
+typedef struct aes128ctr_jit_entry {
+  struct aes128ctr_jit_entry* next; // The next entry in the cache
+  cl_device_id              device; // The device the binary was built for
+  aes128_key_t                 key; // The expanded key baked into the binary
+  aes128_nonce_t             nonce; // The nonce baked into the binary
+  size_t                      size; // The size of the binary
+  unsigned char*            binary; // The device-specific program binary
+} aes128ctr_jit_entry_t;
+
+static aes128ctr_jit_entry_t* aes128ctr_jit_cache = NULL;
+static pthread_mutex_t aes128ctr_jit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Signalled whenever any asynchronous request completes, so that waiters can
+// block without touching a handle the runtime may still be using
+static pthread_mutex_t aes128ctr_async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  aes128ctr_async_cond = PTHREAD_COND_INITIALIZER;
 
 /**
  * Creates an OpenCL device memory buffer.
@@ -94,14 +121,15 @@ cl_int aes128ctr_create_context(cl_context* const context,
  *
  * @param   kernel   An output parameter used to store the kernel.
  * @param   program  The OpenCL program for which to create a kernel.
+ * @param   name     The name of the kernel function.
  *
  * @return           See documentation for OpenCL's `clCreateKernel()`.
  */
 cl_int aes128ctr_create_kernel(cl_kernel* const kernel,
-    cl_program* const program) {
+    cl_program* const program, const char* name) {
   // Allocate storage for an error code and attempt to create the kernel
   cl_int status = CL_SUCCESS;
-  (*kernel) = clCreateKernel(*program, "aes128ctr_encrypt", &status);
+  (*kernel) = clCreateKernel(*program, name, &status);
   return status;
 }
 
@@ -160,6 +188,182 @@ cl_int aes128ctr_create_program(cl_program* const program,
   return status;
 }
 
+/**
+ * Reads the AES128 CTR kernel source code into a newly allocated string.
+ *
+ * @param   source  An output parameter used to store the source code.
+ * @param   length  An output parameter used to store the source length.
+ *
+ * @return          `CL_SUCCESS` on success, `CL_INVALID_PROGRAM` if the source
+ *                  could not be read, or `CL_OUT_OF_HOST_MEMORY`.
+ */
+cl_int aes128ctr_read_source(char** const source, size_t* const length) {
+  FILE* fp = NULL;
+  // Attempt to open the kernel source and determine its size
+  if ((fp = fopen(DSOURCE, "rb")) == NULL) return CL_INVALID_PROGRAM;
+  fseek(fp, 0, SEEK_END); (*length) = ftell(fp); fseek(fp, 0, SEEK_SET);
+  // Allocate space for the source code and read it
+  if (((*source) = (char*)malloc(*length + 1)) == NULL) {
+    fclose(fp);
+    return CL_OUT_OF_HOST_MEMORY;
+  }
+  (*length) = fread(*source, 1, *length, fp);
+  (*source)[*length] = 0;
+  fclose(fp);
+  return CL_SUCCESS;
+}
+
+/**
+ * Formats the build options that bake a key and nonce into the kernel.
+ *
+ * @param   options  An output buffer of at least 1024 bytes.
+ * @param   key      The expanded key to be baked into the kernel.
+ * @param   nonce    The nonce to be baked into the kernel.
+ */
+void aes128ctr_jit_options(char* options, const aes128_key_t* const key,
+    const aes128_nonce_t* const nonce) {
+  options += sprintf(options, "-DAES128CTR_KEY=");
+  for (unsigned int i = 0; i < sizeof(key->val); ++i)
+    options += sprintf(options, "%s0x%02x", i ? "," : "", key->val[i]);
+  options += sprintf(options, " -DAES128CTR_NONCE=");
+  for (unsigned int i = 0; i < sizeof(nonce->val); ++i)
+    options += sprintf(options, "%s0x%02x", i ? "," : "", nonce->val[i]);
+}
+
+/**
+ * Creates and builds an AES128 CTR program with a key and nonce baked into it
+ * as compile-time constants.
+ *
+ * The program is built from source the first time a device, key and nonce are
+ * seen; its binary is then cached in memory so that subsequent contexts using
+ * the same key skip the compiler. The returned program is always created from
+ * the binary, so the runtime never holds on to the key-bearing build options.
+ * Cached binaries contain key material and are wiped by
+ * `aes128ctr_jit_clear()`.
+ *
+ * @param   program  An output parameter used to store the built program.
+ * @param   context  The OpenCL context for which to create a program.
+ * @param   device   The OpenCL device ID for which to create a program.
+ * @param   key      The expanded key to be baked into the program.
+ * @param   nonce    The nonce to be baked into the program.
+ *
+ * @return           See documentation for OpenCL's `clCreateProgramWith*()`
+ *                   and `clBuildProgram()`.
+ */
+cl_int aes128ctr_create_jit_program(cl_program* const program,
+    cl_context* const context, cl_device_id* const device,
+    const aes128_key_t* const key, const aes128_nonce_t* const nonce) {
+  // Create some temporary variables used to create the program
+  aes128ctr_jit_entry_t* entry = NULL;
+  char*                 source = NULL;
+  size_t                length = 0;
+  char             options[1024];
+  cl_int         binary_status = CL_SUCCESS;
+  cl_int                status = CL_SUCCESS;
+  // Look for a cached binary built for this device, key and nonce
+  pthread_mutex_lock(&aes128ctr_jit_lock);
+  for (entry = aes128ctr_jit_cache; entry != NULL; entry = entry->next)
+    if (entry->device == *device &&
+        memcmp(&entry->key,   key,   sizeof(*key))   == 0 &&
+        memcmp(&entry->nonce, nonce, sizeof(*nonce)) == 0) break;
+  if (entry != NULL) {
+    // Create the program from the cached binary
+    (*program) = clCreateProgramWithBinary(*context, 1, device, &entry->size,
+      (const unsigned char**)&entry->binary, &binary_status, &status);
+    pthread_mutex_unlock(&aes128ctr_jit_lock);
+    if (status != CL_SUCCESS || binary_status != CL_SUCCESS)
+      return status == CL_SUCCESS ? binary_status : status;
+    return clBuildProgram(*program, 1, device, NULL, NULL, NULL);
+  }
+  pthread_mutex_unlock(&aes128ctr_jit_lock);
+  // Read the kernel source code so that it can be specialized
+  status = aes128ctr_read_source(&source, &length);
+  if (status != CL_SUCCESS) return status;
+  cl_program built = clCreateProgramWithSource(*context, 1,
+    (const char**)&source, &length, &status);
+  free(source);
+  if (status != CL_SUCCESS) return status;
+  // Build the program with the key and nonce as preprocessor definitions
+  aes128ctr_jit_options(options, key, nonce);
+  status = clBuildProgram(built, 1, device, options, NULL, NULL);
+  // Zero-out the build options since they contain the key
+  aes128_wipe(options, sizeof(options));
+  // Extract the binary, then release the program built from source, since the
+  // runtime keeps a copy of its key-bearing build options for its lifetime
+  if (status == CL_SUCCESS &&
+      (entry = (aes128ctr_jit_entry_t*)calloc(1, sizeof(*entry))) == NULL)
+    status = CL_OUT_OF_HOST_MEMORY;
+  if (status == CL_SUCCESS) {
+    status = clGetProgramInfo(built, CL_PROGRAM_BINARY_SIZES,
+      sizeof(entry->size), &entry->size, NULL);
+    if (status == CL_SUCCESS &&
+        (entry->binary = (unsigned char*)malloc(entry->size)) == NULL)
+      status = CL_OUT_OF_HOST_MEMORY;
+    if (status == CL_SUCCESS)
+      status = clGetProgramInfo(built, CL_PROGRAM_BINARIES,
+        sizeof(entry->binary), &entry->binary, NULL);
+  }
+  clReleaseProgram(built);
+  // Recreate the program from the binary, which carries no build options
+  if (status == CL_SUCCESS) {
+    (*program) = clCreateProgramWithBinary(*context, 1, device, &entry->size,
+      (const unsigned char**)&entry->binary, &binary_status, &status);
+    if (status == CL_SUCCESS) status = binary_status;
+    if (status == CL_SUCCESS)
+      status = clBuildProgram(*program, 1, device, NULL, NULL, NULL);
+  }
+  if (status != CL_SUCCESS) {
+    if (entry != NULL && entry->binary != NULL) {
+      aes128_wipe(entry->binary, entry->size);
+      free(entry->binary);
+    }
+    free(entry);
+    return status;
+  }
+  entry->device = *device;
+  memcpy(&entry->key,   key,   sizeof(*key));
+  memcpy(&entry->nonce, nonce, sizeof(*nonce));
+  // Cache the binary unless another thread cached the same one meanwhile
+  pthread_mutex_lock(&aes128ctr_jit_lock);
+  aes128ctr_jit_entry_t* found = aes128ctr_jit_cache;
+  for (; found != NULL; found = found->next)
+    if (found->device == *device &&
+        memcmp(&found->key,   key,   sizeof(*key))   == 0 &&
+        memcmp(&found->nonce, nonce, sizeof(*nonce)) == 0) break;
+  if (found == NULL) {
+    entry->next = aes128ctr_jit_cache;
+    aes128ctr_jit_cache = entry;
+  }
+  pthread_mutex_unlock(&aes128ctr_jit_lock);
+  if (found != NULL) {
+    unsigned char* binary = entry->binary;
+    // Zero-out the duplicate binary, key and nonce before releasing them
+    aes128_wipe(binary, entry->size);
+    aes128_wipe(entry,  sizeof(*entry));
+    free(binary);
+    free(entry);
+  }
+  return CL_SUCCESS;
+}
+
+/**
+ * Wipes and releases every cached key-specialized program binary.
+ */
+void aes128ctr_jit_clear(void) {
+  pthread_mutex_lock(&aes128ctr_jit_lock);
+  while (aes128ctr_jit_cache != NULL) {
+    aes128ctr_jit_entry_t* entry = aes128ctr_jit_cache;
+    aes128ctr_jit_cache = entry->next;
+    unsigned char* binary = entry->binary;
+    // Zero-out the binary, key and nonce before releasing them
+    aes128_wipe(binary, entry->size);
+    aes128_wipe(entry,  sizeof(*entry));
+    free(binary);
+    free(entry);
+  }
+  pthread_mutex_unlock(&aes128ctr_jit_lock);
+}
+
 /**
  * Fetches an OpenCL device ID based on its index.
  *
@@ -191,6 +395,37 @@ cl_int aes128ctr_get_device_by_index(cl_device_id* const device,
   }
 }
 
+/**
+ * Assigns the memory buffers of a context to the arguments of a cryption
+ * kernel (all but the block offset).
+ *
+ * @param   kernel   The cryption kernel whose arguments should be set.
+ * @param   context  The AES128 CTR context owning the buffers.
+ *
+ * @return           See documentation for OpenCL's `clSetKernelArg()`.
+ */
+cl_int aes128ctr_set_kernel_args(cl_kernel kernel,
+    const aes128ctr_context_t* const context) {
+  cl_int status = CL_SUCCESS;
+  status = clSetKernelArg(kernel, 0,
+    sizeof(context->_st), (void*)&context->_st);
+  if (status != CL_SUCCESS) return status;
+  status = clSetKernelArg(kernel, 1,
+    sizeof(context->_sb), (void*)&context->_sb);
+  if (status != CL_SUCCESS) return status;
+  status = clSetKernelArg(kernel, 2,
+    sizeof(context->_g2), (void*)&context->_g2);
+  if (status != CL_SUCCESS) return status;
+  // The key and nonce are already part of a specialized program
+  if (context->jit) return status;
+  status = clSetKernelArg(kernel, 3,
+    sizeof(context->_k ), (void*)&context->_k );
+  if (status != CL_SUCCESS) return status;
+  status = clSetKernelArg(kernel, 4,
+    sizeof(context->_n ), (void*)&context->_n );
+  return status;
+}
+
 /**
  * Initializes an AES128 CTR context for cryption on a specific OpenCL device.
  *
@@ -205,6 +440,30 @@ cl_int aes128ctr_get_device_by_index(cl_device_id* const device,
 cl_int aes128ctr_init(aes128ctr_context_t* const context,
     const uint64_t device, const uint64_t limit,
     const aes128_key_t* const key, const aes128_nonce_t* const nonce) {
+  return aes128ctr_init_with_options(context, device, limit, key, nonce, NULL);
+}
+
+/**
+ * Initializes an AES128 CTR context for cryption on a specific OpenCL device
+ * using a set of optional tuning parameters.
+ *
+ * When `options` requests a NUMA node or huge pages, the pinned `_st` buffer
+ * is backed by a staging buffer allocated with that placement instead of
+ * letting the OpenCL implementation allocate it.
+ *
+ * @param   context  The AES128 CTR context to be initialized.
+ * @param   device   The zero-index of the desired OpenCL device.
+ * @param   limit    The maximum number of concurrent blocks allowed.
+ * @param   key      The key used to encrypt the plaintext input.
+ * @param   nonce    The nonce used for the CTR block cipher mode.
+ * @param   options  Optional tuning parameters (or `NULL` for defaults).
+ *
+ * @return           An OpenCL status (error) code.
+ */
+cl_int aes128ctr_init_with_options(aes128ctr_context_t* const context,
+    const uint64_t device, const uint64_t limit,
+    const aes128_key_t* const key, const aes128_nonce_t* const nonce,
+    const aes128ctr_options_t* const options) {
   // Create a temporary status variable for error checking
   cl_int status = CL_SUCCESS;
   // Zero-initialize the structure before first use
@@ -221,16 +480,39 @@ cl_int aes128ctr_init(aes128ctr_context_t* const context,
   status = aes128ctr_create_command_queue(&context->queue,
     &context->context, &context->device);
   if (status != CL_SUCCESS) return status;
+  // Determine whether the key should be baked into a specialized program
+  context->jit    = options != NULL && options->jit;
+  context->offset = context->jit ? 3 : 5;
   // Attempt to create a program for this context and device
-  status = aes128ctr_create_program(&context->program,
-    &context->context, &context->device);
+  if (context->jit) {
+    status = aes128ctr_create_jit_program(&context->program,
+      &context->context, &context->device, key, nonce);
+  } else {
+    status = aes128ctr_create_program(&context->program,
+      &context->context, &context->device);
+  }
   if (status != CL_SUCCESS) return status;
-  // Attempt to create a kernel for this program
-  status = aes128ctr_create_kernel(&context->kernel, &context->program);
+  // Attempt to create the cryption and key expansion kernels for this program
+  status = aes128ctr_create_kernel(&context->kernel, &context->program,
+    "aes128ctr_encrypt");
   if (status != CL_SUCCESS) return status;
-  // Attempt to create a pinned memory buffer for storing results
-  status = aes128ctr_create_buffer(&context->_st, &context->context,
-    CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, context->limit << 4, NULL);
+  status = aes128ctr_create_kernel(&context->expand, &context->program,
+    "aes128_key_expand");
+  if (status != CL_SUCCESS) return status;
+  if (options != NULL &&
+      (options->node >= 0 || options->pages != STAGING_PAGES_DEFAULT)) {
+    // Attempt to allocate placed host memory to back the result buffer
+    if (staging_alloc(&context->stage, context->limit << 4,
+        options->node, options->pages) != 0) return CL_OUT_OF_HOST_MEMORY;
+    // Attempt to create a memory buffer for storing results in that memory
+    status = aes128ctr_create_buffer(&context->_st, &context->context,
+      CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, context->limit << 4,
+      context->stage.ptr);
+  } else {
+    // Attempt to create a pinned memory buffer for storing results
+    status = aes128ctr_create_buffer(&context->_st, &context->context,
+      CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, context->limit << 4, NULL);
+  }
   if (status != CL_SUCCESS) return status;
   // Attempt to create a constant memory buffer for the substitution box
   status = aes128ctr_create_buffer(&context->_sb, &context->context,
@@ -240,30 +522,23 @@ cl_int aes128ctr_init(aes128ctr_context_t* const context,
   status = aes128ctr_create_buffer(&context->_g2, &context->context,
     CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(aes_gal2), (void*)aes_gal2);
   if (status != CL_SUCCESS) return status;
-  // Attempt to create a constant memory buffer for the key
-  status = aes128ctr_create_buffer(&context->_k, &context->context,
-    CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(*key), (void*)key);
-  if (status != CL_SUCCESS) return status;
-  // Attempt to create a constant memory buffer for the nonce
-  status = aes128ctr_create_buffer(&context->_n, &context->context,
-    CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(*nonce), (void*)nonce);
-  if (status != CL_SUCCESS) return status;
-  // Assign each memory buffer argument to the kernel
-  status = clSetKernelArg(context->kernel, 0,
-    sizeof(context->_st), (void*)&context->_st);
+  // Attempt to create the key and nonce buffers unless they are baked in
+  if (!context->jit) {
+    // Attempt to create a constant memory buffer for the key
+    status = aes128ctr_create_buffer(&context->_k, &context->context,
+      CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(*key), (void*)key);
+    if (status != CL_SUCCESS) return status;
+    // Attempt to create a constant memory buffer for the nonce
+    status = aes128ctr_create_buffer(&context->_n, &context->context,
+      CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(*nonce), (void*)nonce);
+    if (status != CL_SUCCESS) return status;
+  }
+  // Assign each memory buffer argument to the kernels
+  status = aes128ctr_set_kernel_args(context->kernel, context);
   if (status != CL_SUCCESS) return status;
-  status = clSetKernelArg(context->kernel, 1,
+  status = clSetKernelArg(context->expand, 2,
     sizeof(context->_sb), (void*)&context->_sb);
   if (status != CL_SUCCESS) return status;
-  status = clSetKernelArg(context->kernel, 2,
-    sizeof(context->_g2), (void*)&context->_g2);
-  if (status != CL_SUCCESS) return status;
-  status = clSetKernelArg(context->kernel, 3,
-    sizeof(context->_k ), (void*)&context->_k );
-  if (status != CL_SUCCESS) return status;
-  status = clSetKernelArg(context->kernel, 4,
-    sizeof(context->_n ), (void*)&context->_n );
-  if (status != CL_SUCCESS) return status;
   return status;
 }
 
@@ -275,29 +550,200 @@ cl_int aes128ctr_init(aes128ctr_context_t* const context,
 void aes128ctr_destroy(aes128ctr_context_t* const context) {
   // Attempt to zero-out the sensitive key and nonce buffers
   unsigned char zero = 0;
-  clEnqueueFillBuffer(context->queue, context->_k, &zero, sizeof(zero), 0,
-    sizeof(aes128_key_t), 0, NULL, NULL);
-  clEnqueueFillBuffer(context->queue, context->_n, &zero, sizeof(zero), 0,
-    sizeof(aes128_key_t), 0, NULL, NULL);
+  if (!context->jit) {
+    clEnqueueFillBuffer(context->queue, context->_k, &zero, sizeof(zero), 0,
+      sizeof(aes128_key_t), 0, NULL, NULL);
+    clEnqueueFillBuffer(context->queue, context->_n, &zero, sizeof(zero), 0,
+      sizeof(aes128_nonce_t), 0, NULL, NULL);
+  }
   clFinish(context->queue);
   // Release all OpenCL buffers used during kernel execution
   clReleaseMemObject(context->_st);
   clReleaseMemObject(context->_sb);
   clReleaseMemObject(context->_g2);
-  clReleaseMemObject(context->_k);
-  clReleaseMemObject(context->_n);
-  // Release the OpenCL application kernel
+  if (!context->jit) {
+    clReleaseMemObject(context->_k);
+    clReleaseMemObject(context->_n);
+  }
+  // Release the OpenCL application kernels
   clReleaseKernel(context->kernel);
+  clReleaseKernel(context->expand);
   // Release the OpenCL device-compiled program binary
   clReleaseProgram(context->program);
   // Release the OpenCL command queue
   clReleaseCommandQueue(context->queue);
   // Release the OpenCL execution context
   clReleaseContext(context->context);
+  // Release the host memory backing the result buffer (if any)
+  staging_free(&context->stage);
 }
 
-uint64_t aes128ctr_crypt_blocks(aes128ctr_context_t* const context,
-    aes128_state_t* data, uint64_t count) {
+/**
+ * Replaces the key and nonce of an initialized context and rewinds its block
+ * index, without rebuilding the program or reallocating any buffers.
+ *
+ * Contexts using a key-specialized program switch to the program for the new
+ * key (building it if it is not already cached).
+ *
+ * @param   context  The AES128 CTR context to be rekeyed.
+ * @param   key      The new key used to encrypt the plaintext input.
+ * @param   nonce    The new nonce used for the CTR block cipher mode.
+ *
+ * @return           An OpenCL status (error) code.
+ */
+cl_int aes128ctr_rekey(aes128ctr_context_t* const context,
+    const aes128_key_t* const key, const aes128_nonce_t* const nonce) {
+  cl_int status = CL_SUCCESS;
+  if (context->jit) {
+    cl_program program = NULL;
+    cl_kernel   kernel = NULL;
+    // Attempt to create a program and kernel specialized for the new key
+    status = aes128ctr_create_jit_program(&program,
+      &context->context, &context->device, key, nonce);
+    if (status == CL_SUCCESS)
+      status = aes128ctr_create_kernel(&kernel, &program, "aes128ctr_encrypt");
+    if (status == CL_SUCCESS)
+      status = aes128ctr_set_kernel_args(kernel, context);
+    if (status != CL_SUCCESS) {
+      if (kernel  != NULL) clReleaseKernel(kernel);
+      if (program != NULL) clReleaseProgram(program);
+      return status;
+    }
+    // Replace the previous program and kernel once all pending work is done
+    clFinish(context->queue);
+    clReleaseKernel(context->kernel);
+    clReleaseProgram(context->program);
+    context->kernel  = kernel;
+    context->program = program;
+    // Start the new key stream at the first block
+    context->index   = 0;
+    return status;
+  }
+  // Overwrite the key and nonce buffers in place
+  status = clEnqueueWriteBuffer(context->queue, context->_k, CL_FALSE,
+    0, sizeof(*key), key, 0, NULL, NULL);
+  if (status != CL_SUCCESS) return status;
+  status = clEnqueueWriteBuffer(context->queue, context->_n, CL_FALSE,
+    0, sizeof(*nonce), nonce, 0, NULL, NULL);
+  if (status != CL_SUCCESS) return status;
+  // Wait for the writes so that the caller may wipe its copies
+  status = clFinish(context->queue);
+  // Start the new key stream at the first block (only once it is in place)
+  if (status == CL_SUCCESS) context->index = 0;
+  return status;
+}
+
+/**
+ * Expands many raw keys into key schedules on the device, so that only 16
+ * bytes per key cross the bus.
+ *
+ * The resulting buffer holds `count` schedules in the layout of
+ * `aes128_key_t` and can be used with `aes128ctr_select_key()`. It contains
+ * key material and should be released with `aes128ctr_release_keys()`.
+ *
+ * @param   context    The AES128 CTR context owning the device.
+ * @param   raw        The raw 128-bit keys (16 bytes each).
+ * @param   count      The number of keys to be expanded.
+ * @param   schedules  An output parameter used to store the key schedules.
+ *
+ * @return             An OpenCL status (error) code.
+ */
+cl_int aes128ctr_expand_keys(aes128ctr_context_t* const context,
+    const unsigned char* raw, const uint64_t count, cl_mem* const schedules) {
+  const unsigned char zero = 0;
+  cl_mem            keys = NULL;
+  size_t           items = count;
+  cl_int          status = CL_SUCCESS;
+  (*schedules) = NULL;
+  // Attempt to upload the raw keys and allocate space for their schedules
+  status = aes128ctr_create_buffer(&keys, &context->context,
+    CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, count << 4, (void*)raw);
+  if (status != CL_SUCCESS) return status;
+  status = aes128ctr_create_buffer(schedules, &context->context,
+    CL_MEM_READ_WRITE, count * sizeof(aes128_key_t), NULL);
+  // Expand one key per work item
+  if (status == CL_SUCCESS)
+    status = clSetKernelArg(context->expand, 0, sizeof(keys), &keys);
+  if (status == CL_SUCCESS)
+    status = clSetKernelArg(context->expand, 1, sizeof(*schedules), schedules);
+  if (status == CL_SUCCESS)
+    status = clEnqueueNDRangeKernel(context->queue, context->expand, 1,
+      NULL, &items, NULL, 0, NULL, NULL);
+  // Zero-out and release the raw keys
+  clEnqueueFillBuffer(context->queue, keys, &zero, sizeof(zero), 0,
+    count << 4, 0, NULL, NULL);
+  clFinish(context->queue);
+  clReleaseMemObject(keys);
+  if (status != CL_SUCCESS && (*schedules) != NULL) {
+    clReleaseMemObject(*schedules);
+    (*schedules) = NULL;
+  }
+  return status;
+}
+
+/**
+ * Rekeys a context with one of the key schedules produced by
+ * `aes128ctr_expand_keys()`, copying it on the device, and rewinds its block
+ * index.
+ *
+ * @param   context    The AES128 CTR context to be rekeyed.
+ * @param   schedules  The buffer of key schedules.
+ * @param   index      The index of the key schedule to be used.
+ * @param   nonce      The new nonce used for the CTR block cipher mode.
+ *
+ * @return             An OpenCL status (error) code, or
+ *                     `CL_INVALID_OPERATION` for key-specialized contexts.
+ */
+cl_int aes128ctr_select_key(aes128ctr_context_t* const context,
+    cl_mem schedules, const uint64_t index,
+    const aes128_nonce_t* const nonce) {
+  cl_int status = CL_SUCCESS;
+  // Key-specialized programs can't read their key from a buffer
+  if (context->jit) return CL_INVALID_OPERATION;
+  // Start the new key stream at the first block
+  context->index = 0;
+  // Copy the key schedule into place without leaving the device
+  status = clEnqueueCopyBuffer(context->queue, schedules, context->_k,
+    index * sizeof(aes128_key_t), 0, sizeof(aes128_key_t), 0, NULL, NULL);
+  if (status != CL_SUCCESS) return status;
+  // Overwrite the nonce, waiting so that the caller may wipe its copy
+  return clEnqueueWriteBuffer(context->queue, context->_n, CL_TRUE,
+    0, sizeof(*nonce), nonce, 0, NULL, NULL);
+}
+
+/**
+ * Zeroes and releases a buffer of key schedules.
+ *
+ * @param  context    The AES128 CTR context owning the device.
+ * @param  schedules  The buffer of key schedules.
+ * @param  count      The number of key schedules in the buffer.
+ */
+void aes128ctr_release_keys(aes128ctr_context_t* const context,
+    cl_mem schedules, const uint64_t count) {
+  const unsigned char zero = 0;
+  clEnqueueFillBuffer(context->queue, schedules, &zero, sizeof(zero), 0,
+    count * sizeof(aes128_key_t), 0, NULL, NULL);
+  clFinish(context->queue);
+  clReleaseMemObject(schedules);
+}
+
+/**
+ * Runs the AES128 CTR kernel over a number of blocks in batches of at most
+ * `limit` blocks, starting at the context's current block index.
+ *
+ * @param   context    The AES128 CTR context used for cryption.
+ * @param   data       The blocks to be crypted in place (or the output buffer
+ *                     for the raw key stream).
+ * @param   count      The number of blocks to be processed.
+ * @param   keystream  Whether to output the raw key stream instead of crypting
+ *                     `data` (the input upload is replaced by a device-side
+ *                     fill of zeroes).
+ *
+ * @return             The number of blocks that were processed.
+ */
+uint64_t aes128ctr_run_blocks(aes128ctr_context_t* const context,
+    aes128_state_t* data, uint64_t count, const int keystream) {
+  const aes128_state_t zero = { { 0 } };
   cl_int       status = CL_SUCCESS;
   // Keep track of the amount of encrypted blocks
   uint64_t start = context->index;
@@ -305,19 +751,25 @@ uint64_t aes128ctr_crypt_blocks(aes128ctr_context_t* const context,
   while (status == CL_SUCCESS && count > 0) {
     // Determine the number of blocks to encrypt this round
     unsigned long blocks = MIN(context->limit, count);
-    // Write the input data into the encryption buffer
-    status = clEnqueueWriteBuffer(context->queue, context->_st, CL_FALSE,
-      0, blocks << 4, data, 0, NULL, NULL);
+    if (keystream) {
+      // Clear the encryption buffer on the device so only key stream remains
+      status = clEnqueueFillBuffer(context->queue, context->_st, &zero,
+        sizeof(zero), 0, blocks << 4, 0, NULL, NULL);
+    } else {
+      // Write the input data into the encryption buffer
+      status = clEnqueueWriteBuffer(context->queue, context->_st, CL_FALSE,
+        0, blocks << 4, data, 0, NULL, NULL);
+    }
     if (status != CL_SUCCESS) break;
     // Set the block index offset kernel argument
-    status = clSetKernelArg(context->kernel, 5,
+    status = clSetKernelArg(context->kernel, context->offset,
       sizeof(context->index), &context->index);
-    if (status != CL_SUCCESS) return status;
+    if (status != CL_SUCCESS) break;
     // Enqueue the pending number of kernels to the OpenCL device for execution
     status = clEnqueueNDRangeKernel(context->queue, context->kernel, 1,
       NULL, &blocks, NULL, 0, NULL, NULL);
-    if (status != CL_SUCCESS) return status;
-    // Write the input data into the encryption buffer
+    if (status != CL_SUCCESS) break;
+    // Read the results out of the encryption buffer
     status = clEnqueueReadBuffer (context->queue, context->_st, CL_TRUE,
       0, blocks << 4, data, 0, NULL, NULL);
     if (status != CL_SUCCESS) break;
@@ -329,3 +781,308 @@ uint64_t aes128ctr_crypt_blocks(aes128ctr_context_t* const context,
   // Return the number of encrypted blocks
   return context->index - start;
 }
+
+/**
+ * Crypts a number of blocks in place, starting at the context's current block
+ * index.
+ *
+ * @param   context  The AES128 CTR context used for cryption.
+ * @param   data     The blocks to be crypted in place.
+ * @param   count    The number of blocks to be crypted.
+ *
+ * @return           The number of blocks that were crypted.
+ */
+uint64_t aes128ctr_crypt_blocks(aes128ctr_context_t* const context,
+    aes128_state_t* data, uint64_t count) {
+  return aes128ctr_run_blocks(context, data, count, 0);
+}
+
+/**
+ * Writes the raw key stream for a number of blocks, starting at the context's
+ * current block index, without uploading any input.
+ *
+ * @param   context  The AES128 CTR context used to generate the key stream.
+ * @param   data     The output buffer for the key stream.
+ * @param   count    The number of blocks of key stream to be generated.
+ *
+ * @return           The number of blocks that were generated.
+ */
+uint64_t aes128ctr_keystream_blocks(aes128ctr_context_t* const context,
+    aes128_state_t* data, uint64_t count) {
+  return aes128ctr_run_blocks(context, data, count, 1);
+}
+
+/**
+ * Prepares a handle for an asynchronous request.
+ *
+ * @param  handle    The handle to be prepared.
+ * @param  callback  A function to call on completion (or `NULL`).
+ * @param  user      An opaque pointer passed to `callback`.
+ * @param  notify    A file descriptor to signal on completion by writing an
+ *                   8-byte count of one (as expected by an eventfd), or -1.
+ *                   Many handles may share one descriptor.
+ */
+void aes128ctr_async_init(aes128ctr_async_t* const handle,
+    aes128ctr_callback_t callback, void* user, const int notify) {
+  memset(handle, 0, sizeof(*handle));
+  atomic_init(&handle->done, 0);
+  handle->callback = callback;
+  handle->user     = user;
+  handle->notify   = notify;
+}
+
+/**
+ * Records the completion of an asynchronous request and notifies its owner.
+ *
+ * The callback runs first and `done` is published after it returns; from then
+ * on the handle is never touched again (waiters are woken through a shared
+ * condition and the descriptor is signaled from a local copy), so a thread
+ * that sees `done` may release or free it at once.
+ *
+ * @param  event   The event of the request's final read.
+ * @param  status  The execution status of the event.
+ * @param  data    The request's handle.
+ */
+void CL_CALLBACK aes128ctr_async_complete(cl_event event, cl_int status,
+    void* data) {
+  aes128ctr_async_t*        handle = (aes128ctr_async_t*)data;
+  const aes128ctr_callback_t  func = handle->callback;
+  void* const                 user = handle->user;
+  const int                 notify = handle->notify;
+  const uint64_t               one = 1;
+  (void)event;
+  handle->status = status == CL_COMPLETE ? CL_SUCCESS : status;
+  if (func != NULL) func(handle, user);
+  // Publish completion last; the handle may be freed from here on
+  pthread_mutex_lock(&aes128ctr_async_lock);
+  atomic_store(&handle->done, 1);
+  pthread_cond_broadcast(&aes128ctr_async_cond);
+  pthread_mutex_unlock(&aes128ctr_async_lock);
+  // Signal after `done` so that a woken owner always finds it set
+  if (notify >= 0) {
+    ssize_t result;
+    do result = write(notify, &one, sizeof(one));
+    while (result < 0 && errno == EINTR);
+  }
+}
+
+/**
+ * Enqueues the cryption of a number of blocks in place and returns at once.
+ *
+ * Block indices are reserved when the request is enqueued, so requests may be
+ * issued back to back and many can be outstanding at once; the in-order queue
+ * lets them share the context's `_st` buffer. `data` and `handle` must stay
+ * valid, and `data` untouched, until the request completes. Completion is
+ * reported through the handle's callback and notification descriptor, and can
+ * also be polled or awaited. The context itself must not be used from other
+ * threads while enqueuing.
+ *
+ * If enqueuing fails partway, the batches already enqueued are finished before
+ * returning, so `data` may be partly crypted: the handle's `count` is reduced
+ * to the number of leading blocks that were crypted (the rest are untouched),
+ * and a completion carrying the error status is reported before returning.
+ *
+ * @param   context  The AES128 CTR context used for cryption.
+ * @param   data     The blocks to be crypted in place.
+ * @param   count    The number of blocks to be crypted.
+ * @param   handle   A handle prepared by `aes128ctr_async_init()`.
+ *
+ * @return           An OpenCL status (error) code.
+ */
+cl_int aes128ctr_crypt_async(aes128ctr_context_t* const context,
+    aes128_state_t* data, uint64_t count, aes128ctr_async_t* const handle) {
+  cl_int status = CL_SUCCESS;
+  // Reserve the block indices of this request
+  handle->index = context->index;
+  handle->count = count;
+  handle->event = NULL;
+  // Enqueue every batch without waiting for any of them
+  while (status == CL_SUCCESS && count > 0) {
+    unsigned long blocks = MIN(context->limit, count);
+    status = clEnqueueWriteBuffer(context->queue, context->_st, CL_FALSE,
+      0, blocks << 4, data, 0, NULL, NULL);
+    if (status != CL_SUCCESS) break;
+    status = clSetKernelArg(context->kernel, context->offset,
+      sizeof(context->index), &context->index);
+    if (status != CL_SUCCESS) break;
+    status = clEnqueueNDRangeKernel(context->queue, context->kernel, 1,
+      NULL, &blocks, NULL, 0, NULL, NULL);
+    if (status != CL_SUCCESS) break;
+    // Only the final read's event is kept, since the queue runs in order
+    if (handle->event != NULL) clReleaseEvent(handle->event);
+    status = clEnqueueReadBuffer (context->queue, context->_st, CL_FALSE,
+      0, blocks << 4, data, 0, NULL, &handle->event);
+    if (status != CL_SUCCESS) { handle->event = NULL; break; }
+    context->index += blocks;
+    data           += blocks;
+    count          -= blocks;
+  }
+  // An empty request completes immediately
+  if (status == CL_SUCCESS && handle->event == NULL) {
+    aes128ctr_async_complete(NULL, CL_COMPLETE, handle);
+    return status;
+  }
+  if (status == CL_SUCCESS)
+    status = clSetEventCallback(handle->event, CL_COMPLETE,
+      aes128ctr_async_complete, handle);
+  if (status != CL_SUCCESS) {
+    // Don't return while enqueued commands may still touch the caller's data,
+    // then report how much of it was crypted along with the error
+    clFinish(context->queue);
+    aes128ctr_async_release(handle);
+    handle->count = context->index - handle->index;
+    aes128ctr_async_complete(NULL, status, handle);
+    return status;
+  }
+  // Submit the commands to the device
+  return clFlush(context->queue);
+}
+
+/**
+ * Checks whether an asynchronous request has completed. Once this returns 1
+ * the handle is no longer used by the runtime and may be released or freed.
+ *
+ * @param   handle  The handle of the request.
+ *
+ * @return          1 if the request has completed, otherwise 0.
+ */
+int aes128ctr_async_done(aes128ctr_async_t* const handle) {
+  return atomic_load(&handle->done);
+}
+
+/**
+ * Blocks until an asynchronous request has completed (after its callback has
+ * returned), after which the handle may be released or freed.
+ *
+ * @param   handle  The handle of the request.
+ *
+ * @return          The completion status of the request.
+ */
+cl_int aes128ctr_async_wait(aes128ctr_async_t* const handle) {
+  // Sleep until the completion callback has returned and published `done`
+  pthread_mutex_lock(&aes128ctr_async_lock);
+  while (!atomic_load(&handle->done))
+    pthread_cond_wait(&aes128ctr_async_cond, &aes128ctr_async_lock);
+  pthread_mutex_unlock(&aes128ctr_async_lock);
+  return handle->status;
+}
+
+/**
+ * Releases the resources held by the handle of a completed request.
+ *
+ * @param  handle  The handle of the request.
+ */
+void aes128ctr_async_release(aes128ctr_async_t* const handle) {
+  if (handle->event != NULL) clReleaseEvent(handle->event);
+  handle->event = NULL;
+}
+
+/**
+ * Initializes an AES128 CTR context that can be shared by many threads.
+ *
+ * The device, program and constant buffers (`_sb`, `_g2`, `_k` and `_n`) are
+ * created once here; each thread then creates an `aes128ctr_worker_t` holding
+ * its own command queue and `_st` buffer. Block indices are handed out to the
+ * workers atomically, so no two cryption requests reuse a counter value. The
+ * key and nonce are fixed for the lifetime of the shared context.
+ *
+ * @param   shared   The shared AES128 CTR context to be initialized.
+ * @param   device   The zero-index of the desired OpenCL device.
+ * @param   limit    The maximum number of concurrent blocks per worker.
+ * @param   key      The key used to encrypt the plaintext input.
+ * @param   nonce    The nonce used for the CTR block cipher mode.
+ * @param   options  Optional tuning parameters (or `NULL` for defaults).
+ *
+ * @return           An OpenCL status (error) code.
+ */
+cl_int aes128ctr_shared_init(aes128ctr_shared_t* const shared,
+    const uint64_t device, const uint64_t limit,
+    const aes128_key_t* const key, const aes128_nonce_t* const nonce,
+    const aes128ctr_options_t* const options) {
+  shared->limit = limit;
+  atomic_init(&shared->index, 0);
+  // The base context never crypts, so it only needs a one-block `_st` buffer
+  return aes128ctr_init_with_options(&shared->base, device, 1,
+    key, nonce, options);
+}
+
+/**
+ * Release all resources used by a shared context. All of its workers must
+ * have been destroyed beforehand.
+ *
+ * @param  shared  The shared AES128 CTR context to be destroyed.
+ */
+void aes128ctr_shared_destroy(aes128ctr_shared_t* const shared) {
+  aes128ctr_destroy(&shared->base);
+}
+
+/**
+ * Initializes a per-thread worker for a shared AES128 CTR context.
+ *
+ * @param   worker  The worker to be initialized.
+ * @param   shared  The shared AES128 CTR context to crypt with.
+ *
+ * @return          An OpenCL status (error) code.
+ */
+cl_int aes128ctr_worker_init(aes128ctr_worker_t* const worker,
+    aes128ctr_shared_t* const shared) {
+  cl_int status = CL_SUCCESS;
+  // Borrow the shared handles, keeping none of the base's per-thread objects
+  worker->shared  = shared;
+  worker->context = shared->base;
+  worker->context.queue  = NULL;
+  worker->context.kernel = NULL;
+  worker->context.expand = NULL;
+  worker->context._st    = NULL;
+  worker->context.limit  = shared->limit;
+  worker->context.index  = 0;
+  memset(&worker->context.stage, 0, sizeof(worker->context.stage));
+  // Attempt to create a command queue for this thread
+  status = aes128ctr_create_command_queue(&worker->context.queue,
+    &worker->context.context, &worker->context.device);
+  if (status != CL_SUCCESS) return status;
+  // Attempt to create a kernel whose arguments only this thread will set
+  status = aes128ctr_create_kernel(&worker->context.kernel,
+    &worker->context.program, "aes128ctr_encrypt");
+  if (status != CL_SUCCESS) return status;
+  // Attempt to create a pinned memory buffer for storing results
+  status = aes128ctr_create_buffer(&worker->context._st,
+    &worker->context.context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+    worker->context.limit << 4, NULL);
+  if (status != CL_SUCCESS) return status;
+  return aes128ctr_set_kernel_args(worker->context.kernel, &worker->context);
+}
+
+/**
+ * Release the per-thread resources used by a worker.
+ *
+ * @param  worker  The worker to be destroyed.
+ */
+void aes128ctr_worker_destroy(aes128ctr_worker_t* const worker) {
+  clFinish(worker->context.queue);
+  clReleaseMemObject(worker->context._st);
+  clReleaseKernel(worker->context.kernel);
+  clReleaseCommandQueue(worker->context.queue);
+  memset(worker, 0, sizeof(*worker));
+}
+
+/**
+ * Crypts a number of blocks in place using the next unreserved range of block
+ * indices of the shared context. Safe to call concurrently from each thread's
+ * own worker.
+ *
+ * @param   worker  The calling thread's worker.
+ * @param   data    The blocks to be crypted in place.
+ * @param   count   The number of blocks to be crypted.
+ * @param   index   An output parameter used to store the first block index
+ *                  of the reserved range (or `NULL`).
+ *
+ * @return          The number of blocks that were crypted.
+ */
+uint64_t aes128ctr_worker_crypt_blocks(aes128ctr_worker_t* const worker,
+    aes128_state_t* data, uint64_t count, uint64_t* const index) {
+  // Atomically reserve a range of block indices for this request
+  worker->context.index = atomic_fetch_add(&worker->shared->index, count);
+  if (index != NULL) (*index) = worker->context.index;
+  return aes128ctr_crypt_blocks(&worker->context, data, count);
+}
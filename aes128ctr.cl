@@ -17,6 +17,21 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+/**
+ * When built at runtime with `-DAES128CTR_KEY=...` and `-DAES128CTR_NONCE=...`
+ * (comma-separated byte literals), the expanded key and nonce are baked into
+ * the program as constants instead of being passed as kernel arguments. This
+ * lets the compiler turn every key load into an immediate operand.
+ */
+#ifdef AES128CTR_KEY
+__constant unsigned char _k[176] = { AES128CTR_KEY   };
+__constant unsigned char _n[  8] = { AES128CTR_NONCE };
+#define AES128CTR_KEY_PARAMS
+#else
+#define AES128CTR_KEY_PARAMS \
+    __constant unsigned char* const _k, __constant unsigned char* const _n,
+#endif
+
 /**
  * An unrolled, instruction optimized AES128 CTR encryption kernel.
  *
@@ -30,14 +45,13 @@
  * @param  st  An output parameter used to store the results.
  * @param  sb  The byte-value keyed substitution box of AES.
  * @param  g2  The byte-value keyed Galois Field of 2**8.
- * @param  _k  The user-specified 128-bit key buffer.
- * @param  _n  The user-specified 64-bit nonce buffer.
+ * @param  _k  The user-specified 128-bit key buffer (omitted when baked in).
+ * @param  _n  The user-specified 64-bit nonce buffer (omitted when baked in).
  * @param  _b  The last ciphertext block offset before this batch began.
  */
 __kernel void aes128ctr_encrypt(        __global   unsigned char* st,
     __constant unsigned char* const sb, __constant unsigned char* const g2,
-    __constant unsigned char* const _k, __constant unsigned char* const _n,
-               unsigned long        _b  ) {
+    AES128CTR_KEY_PARAMS               unsigned long        _b  ) {
   _b += get_global_id(0);
   st += get_global_id(0) << 4;
   unsigned char* _c = (unsigned char*)&_b;
@@ -250,3 +264,39 @@ __kernel void aes128ctr_encrypt(        __global   unsigned char* st,
   st[14]  ^=    _k[174] ^ _s[14];
   st[15]  ^=    _k[175] ^ _s[15];
 }
+
+__constant unsigned char aes128_rcon[10] = {
+  0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36
+};
+
+/**
+ * Expands raw 128-bit keys into full AES128 key schedules on the device, so
+ * that only 16 bytes per key need to cross the bus.
+ *
+ * Each work item expands one key, producing the same 176-byte layout as the
+ * host's `aes128_key_init()`.
+ *
+ * @param  in  The raw keys (16 bytes each).
+ * @param  ks  An output parameter used to store the key schedules (176 bytes
+ *             each).
+ * @param  sb  The byte-value keyed substitution box of AES.
+ */
+__kernel void aes128_key_expand(__global const unsigned char* in,
+    __global unsigned char* ks, __constant unsigned char* const sb) {
+  in += get_global_id(0) << 4;
+  ks += get_global_id(0) * 176;
+  unsigned char _w[16];
+  for (int i = 0; i < 16; ++i)
+    ks[i] = _w[i] = in[i];
+  for (int r = 0; r < 10; ++r) {
+    _w[ 0] ^= sb[_w[13]] ^ aes128_rcon[r];
+    _w[ 1] ^= sb[_w[14]];
+    _w[ 2] ^= sb[_w[15]];
+    _w[ 3] ^= sb[_w[12]];
+    for (int i = 4; i < 16; ++i)
+      _w[i] ^= _w[i - 4];
+    ks += 16;
+    for (int i = 0; i < 16; ++i)
+      ks[i] = _w[i];
+  }
+}
@@ -20,6 +20,7 @@
 #ifndef __AES128_BUFFER_H
 #define __AES128_BUFFER_H
 
+#include <stdatomic.h>
 #include <stddef.h>
 
 #ifdef __APPLE__
@@ -28,6 +29,24 @@
   #include <CL/opencl.h>
 #endif
 
+#include "staging.h"
+
+#define AES128CTR_MAX_NODES (64) // The most nodes a file can be split across
+
+typedef struct {
+  int               node; // The NUMA node holding the staging buffer (or -1)
+  staging_pages_t  pages; // The page size backing the staging buffer
+  int                jit; // Whether to bake the key into a specialized kernel
+  int           zerocopy; // Whether to map streamed output into a pipe
+  int              force; // Whether to recrypt a started or completed shard
+  int         node_count; // The number of nodes to split a file across
+  int nodes[AES128CTR_MAX_NODES]; // The nodes to split a file across
+} aes128ctr_options_t;
+
+// The options used when none are given (staging memory is not bound)
+#define AES128CTR_OPTIONS_DEFAULT \
+  { -1, STAGING_PAGES_DEFAULT, 0, 0, 0, 0, { 0 } }
+
 typedef struct {
   /**
    * Variables pertaining to the execution context of the AES128 CTR OpenCL
@@ -38,6 +57,9 @@ typedef struct {
   cl_command_queue queue; // The command queue for the execution context
   cl_program     program; // The compiled program containing the kernel
   cl_kernel       kernel; // The kernel to be ran on the OpenCL device
+  cl_kernel       expand; // The kernel expanding raw keys on the device
+  cl_uint         offset; // The kernel argument index of the block offset
+  int                jit; // Whether the key is baked into the program
 
   /**
    * Variables used for the AES128 algorithm in the OpenCL kernel.
@@ -47,17 +69,114 @@ typedef struct {
   cl_mem             _g2; // The "times 2" Galois field 2**8
   cl_mem              _k; // The prepared key space for each AES round
   cl_mem              _n; // The constant nonce value used for CTR mode
+                          // (`_k` and `_n` are unused when `jit` is set)
   uint64_t         limit; // The maximum number of concurrent blocks allowed
   uint64_t         index; // The next block index to be encrypted
+  staging_t        stage; // Host memory backing `_st` when placement is set
 } aes128ctr_context_t;
 
+typedef struct {
+  /**
+   * The device, execution context, program and constant buffers shared by all
+   * workers. Its own queue and `_st` buffer are only used for setup/teardown.
+   */
+  aes128ctr_context_t base;
+  uint64_t           limit; // The maximum concurrent blocks of each worker
+  _Atomic uint64_t   index; // The next unreserved block index
+} aes128ctr_shared_t;
+
+typedef struct {
+  /**
+   * A per-thread command queue, kernel and `_st` buffer; all other handles are
+   * borrowed from `shared` and must not be released through this context.
+   */
+  aes128ctr_context_t context;
+  aes128ctr_shared_t*  shared; // The shared context this worker belongs to
+} aes128ctr_worker_t;
+
+typedef struct aes128ctr_async aes128ctr_async_t;
+
+/**
+ * Called once an asynchronous request completes (from an OpenCL runtime
+ * thread, so it must not block for long, or from the enqueuing thread if the
+ * request was empty or failed to enqueue). The callback may read the handle
+ * but must not free or reuse it, and must not keep using it after returning:
+ * the runtime marks the handle done once the callback returns. Only after
+ * `aes128ctr_async_done()`, `aes128ctr_async_wait()` or the notification
+ * descriptor report completion may the handle be released or freed.
+ */
+typedef void (*aes128ctr_callback_t)(aes128ctr_async_t* handle, void* user);
+
+struct aes128ctr_async {
+  cl_event              event; // The event of the request's final read
+  _Atomic int            done; // Whether the request has completed
+  cl_int               status; // The completion status of the request
+  uint64_t              index; // The first block index of the request
+  uint64_t              count; // The number of blocks in the request (only
+                               // the leading ones crypted if it failed to
+                               // enqueue; see `status`)
+  aes128ctr_callback_t callback; // Called on completion (or `NULL`)
+  void*                  user; // An opaque pointer passed to `callback`
+  int                  notify; // An fd (e.g. an eventfd) signaled on
+                               // completion, or -1
+};
+
 extern cl_int aes128ctr_init(aes128ctr_context_t* const context,
   const uint64_t device, const uint64_t limit,
   const aes128_key_t* const key, const aes128_nonce_t* const nonce);
 
+extern cl_int aes128ctr_init_with_options(aes128ctr_context_t* const context,
+  const uint64_t device, const uint64_t limit,
+  const aes128_key_t* const key, const aes128_nonce_t* const nonce,
+  const aes128ctr_options_t* const options);
+
 extern void aes128ctr_destroy(aes128ctr_context_t* const context);
 
+extern cl_int aes128ctr_rekey(aes128ctr_context_t* const context,
+  const aes128_key_t* const key, const aes128_nonce_t* const nonce);
+
+extern cl_int aes128ctr_expand_keys(aes128ctr_context_t* const context,
+  const unsigned char* raw, const uint64_t count, cl_mem* const schedules);
+
+extern cl_int aes128ctr_select_key(aes128ctr_context_t* const context,
+  cl_mem schedules, const uint64_t index, const aes128_nonce_t* const nonce);
+
+extern void aes128ctr_release_keys(aes128ctr_context_t* const context,
+  cl_mem schedules, const uint64_t count);
+
+extern void aes128ctr_jit_clear(void);
+
 extern uint64_t aes128ctr_crypt_blocks(aes128ctr_context_t* const context,
   aes128_state_t* data, uint64_t count);
 
+extern uint64_t aes128ctr_keystream_blocks(aes128ctr_context_t* const context,
+  aes128_state_t* data, uint64_t count);
+
+extern void aes128ctr_async_init(aes128ctr_async_t* const handle,
+  aes128ctr_callback_t callback, void* user, const int notify);
+
+extern cl_int aes128ctr_crypt_async(aes128ctr_context_t* const context,
+  aes128_state_t* data, uint64_t count, aes128ctr_async_t* const handle);
+
+extern int aes128ctr_async_done(aes128ctr_async_t* const handle);
+
+extern cl_int aes128ctr_async_wait(aes128ctr_async_t* const handle);
+
+extern void aes128ctr_async_release(aes128ctr_async_t* const handle);
+
+extern cl_int aes128ctr_shared_init(aes128ctr_shared_t* const shared,
+  const uint64_t device, const uint64_t limit,
+  const aes128_key_t* const key, const aes128_nonce_t* const nonce,
+  const aes128ctr_options_t* const options);
+
+extern void aes128ctr_shared_destroy(aes128ctr_shared_t* const shared);
+
+extern cl_int aes128ctr_worker_init(aes128ctr_worker_t* const worker,
+  aes128ctr_shared_t* const shared);
+
+extern void aes128ctr_worker_destroy(aes128ctr_worker_t* const worker);
+
+extern uint64_t aes128ctr_worker_crypt_blocks(aes128ctr_worker_t* const worker,
+  aes128_state_t* data, uint64_t count, uint64_t* const index);
+
 #endif
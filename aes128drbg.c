@@ -0,0 +1,213 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes2.
+ *
+ * clayfreeman/aes2 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes2; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aes128.h"
+#include "aes128ctr.h"
+#include "aes128drbg.h"
+#include "staging.h"
+
+#define MIN(a,b) (a < b ? a : b)
+
+/**
+ * Derives a new key and nonce from the generator's own key stream, optionally
+ * mixing in fresh seed material (the CTR_DRBG "update" step).
+ *
+ * Since the previous key can't be recovered from the new one, output that has
+ * already been returned can't be reconstructed if the state later leaks.
+ *
+ * @param   drbg  The generator to be updated.
+ * @param   seed  Seed material to mix into the new state (or `NULL`).
+ *
+ * @return        An OpenCL status (error) code.
+ */
+cl_int aes128drbg_update(aes128drbg_t* const drbg,
+    const unsigned char seed[AES128DRBG_SEED]) {
+  aes128_state_t   tmp[2];
+  aes128_key_t     key;
+  aes128_nonce_t nonce;
+  cl_int        status = CL_INVALID_OPERATION;
+  // Refuse to advance a generator whose state may already be stale
+  if (drbg->error != CL_SUCCESS) return drbg->error;
+  // Generate two fresh blocks of key stream for the new state
+  if (aes128ctr_keystream_blocks(&drbg->context, tmp, 2) == 2) {
+    unsigned char* bytes = (unsigned char*)tmp;
+    // Mix in any provided seed material
+    for (unsigned int i = 0; seed != NULL && i < AES128DRBG_SEED; ++i)
+      bytes[i] ^= seed[i];
+    // Replace the key and nonce with the derived values
+    memcpy(key.val,   bytes,                   16);
+    memcpy(nonce.val, bytes + 16, sizeof(nonce.val));
+    aes128_key_init(&key);
+    status = aes128ctr_rekey(&drbg->context, &key, &nonce);
+  }
+  // Zero-initialize the nonce, key and key stream for security
+  aes128_wipe(nonce.val, sizeof(nonce.val));
+  aes128_wipe(  key.val, sizeof(  key.val));
+  aes128_wipe(      tmp, sizeof(      tmp));
+  // A failed update may leave the previous state in place, so any further
+  // output could repeat output that was already produced
+  if (status != CL_SUCCESS) drbg->error = status;
+  return status;
+}
+
+/**
+ * Initializes an AES128 CTR based deterministic random bit generator.
+ *
+ * The generator starts from an all-zero key and nonce and immediately mixes
+ * in the seed, as CTR_DRBG instantiation (without a derivation function) does.
+ *
+ * @param   drbg     The generator to be initialized.
+ * @param   device   The zero-index of the desired OpenCL device.
+ * @param   limit    The maximum number of concurrent blocks allowed.
+ * @param   seed     The seed (at least 192 bits of entropy are expected).
+ * @param   options  Optional tuning parameters (or `NULL` for defaults).
+ *
+ * @return           An OpenCL status (error) code.
+ */
+cl_int aes128drbg_init(aes128drbg_t* const drbg,
+    const uint64_t device, const uint64_t limit,
+    const unsigned char seed[AES128DRBG_SEED],
+    const aes128ctr_options_t* const options) {
+  aes128ctr_options_t   tuned = AES128CTR_OPTIONS_DEFAULT;
+  aes128_key_t            key;
+  aes128_nonce_t        nonce;
+  cl_int               status = CL_SUCCESS;
+  // Zero-initialize the structure before first use
+  memset(drbg, 0, sizeof(*drbg));
+  // The key changes after every request, so never specialize the kernel
+  if (options != NULL) tuned = (*options);
+  tuned.jit = 0;
+  // Attempt to allocate staging memory for writes to a descriptor
+  if (staging_alloc(&drbg->buffer, limit << 4, tuned.node, tuned.pages) != 0)
+    return CL_OUT_OF_HOST_MEMORY;
+  // Start from an all-zero key and nonce
+  memset(key.val,   0, sizeof(key.val));
+  memset(nonce.val, 0, sizeof(nonce.val));
+  aes128_key_init(&key);
+  status = aes128ctr_init_with_options(&drbg->context, device, limit,
+    &key, &nonce, &tuned);
+  aes128_wipe(key.val, sizeof(key.val));
+  if (status != CL_SUCCESS) {
+    staging_free(&drbg->buffer);
+    return status;
+  }
+  // Mix in the seed
+  return aes128drbg_update(drbg, seed);
+}
+
+/**
+ * Release all resources used by the generator.
+ *
+ * @param  drbg  The generator to be destroyed.
+ */
+void aes128drbg_destroy(aes128drbg_t* const drbg) {
+  aes128ctr_destroy(&drbg->context);
+  staging_free(&drbg->buffer);
+}
+
+/**
+ * Mixes fresh seed material into the generator's state.
+ *
+ * @param   drbg  The generator to be reseeded.
+ * @param   seed  The new seed (at least 192 bits of entropy are expected).
+ *
+ * @return        An OpenCL status (error) code.
+ */
+cl_int aes128drbg_reseed(aes128drbg_t* const drbg,
+    const unsigned char seed[AES128DRBG_SEED]) {
+  return aes128drbg_update(drbg, seed);
+}
+
+/**
+ * Fills a caller-provided buffer with pseudorandom bytes.
+ *
+ * @param   drbg    The generator used to produce the bytes.
+ * @param   out     The buffer to be filled.
+ * @param   length  The number of bytes to be generated.
+ *
+ * @return          An OpenCL status (error) code.
+ */
+cl_int aes128drbg_fill(aes128drbg_t* const drbg, void* out,
+    const uint64_t length) {
+  aes128_state_t tail;
+  uint64_t     blocks = length >> 4;
+  // Refuse to produce output after any earlier failure
+  if (drbg->error != CL_SUCCESS) return drbg->error;
+  // Generate all complete blocks directly into the output buffer
+  if (aes128ctr_keystream_blocks(&drbg->context,
+      (aes128_state_t*)out, blocks) != blocks)
+    return (drbg->error = CL_INVALID_OPERATION);
+  // Generate any partial block through a temporary so that it can't overrun
+  if ((length & 15) > 0) {
+    if (aes128ctr_keystream_blocks(&drbg->context, &tail, 1) != 1)
+      return (drbg->error = CL_INVALID_OPERATION);
+    memcpy((unsigned char*)out + (blocks << 4), tail.val, length & 15);
+    aes128_wipe(&tail, sizeof(tail));
+  }
+  // Advance the state so that this output can't be reproduced
+  return aes128drbg_update(drbg, NULL);
+}
+
+/**
+ * Writes pseudorandom bytes to a file descriptor in batches of `limit` blocks.
+ *
+ * @param   drbg     The generator used to produce the bytes.
+ * @param   fd       The file descriptor to be written.
+ * @param   length   The number of bytes to be written.
+ * @param   written  An output parameter used to store the number of bytes
+ *                   that were written (less than `length` on a write error,
+ *                   with `errno` set).
+ *
+ * @return           An OpenCL status (error) code; the generator refuses all
+ *                   further output if this is not `CL_SUCCESS`.
+ */
+cl_int aes128drbg_fill_fd(aes128drbg_t* const drbg, const int fd,
+    const uint64_t length, uint64_t* const written) {
+  unsigned char* buffer = (unsigned char*)drbg->buffer.ptr;
+  (*written) = 0;
+  // Refuse to produce output after any earlier failure
+  if (drbg->error != CL_SUCCESS) return drbg->error;
+  while ((*written) < length) {
+    // Generate the next batch of key stream
+    uint64_t bytes  = MIN(drbg->context.limit << 4, length - (*written));
+    uint64_t blocks = (bytes + 15) >> 4;
+    if (aes128ctr_keystream_blocks(&drbg->context,
+        (aes128_state_t*)buffer, blocks) != blocks) {
+      drbg->error = CL_INVALID_OPERATION;
+      break;
+    }
+    // Write the entire batch, retrying short writes
+    uint64_t done = 0;
+    while (done < bytes) {
+      ssize_t result = write(fd, buffer + done, bytes - done);
+      if (result < 0 && errno == EINTR) continue;
+      if (result <= 0) break;
+      done += result;
+    }
+    (*written) += done;
+    if (done < bytes) break;
+  }
+  // Zero-out the staging memory and advance the state
+  aes128_wipe(buffer, drbg->buffer.size);
+  return aes128drbg_update(drbg, NULL);
+}
@@ -0,0 +1,53 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes2.
+ *
+ * clayfreeman/aes2 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes2; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AES128DRBG_H
+#define __AES128DRBG_H
+
+#include <stdint.h>
+
+#include "aes128.h"
+#include "aes128ctr.h"
+#include "staging.h"
+
+#define AES128DRBG_SEED (24) // The seed length (a raw key and a nonce)
+
+typedef struct {
+  aes128ctr_context_t context; // The engine generating the key stream
+  staging_t            buffer; // Staging memory for writes to a descriptor
+  cl_int                error; // The first failure (no output once set)
+} aes128drbg_t;
+
+extern cl_int aes128drbg_init(aes128drbg_t* const drbg,
+  const uint64_t device, const uint64_t limit,
+  const unsigned char seed[AES128DRBG_SEED],
+  const aes128ctr_options_t* const options);
+
+extern void aes128drbg_destroy(aes128drbg_t* const drbg);
+
+extern cl_int aes128drbg_reseed(aes128drbg_t* const drbg,
+  const unsigned char seed[AES128DRBG_SEED]);
+
+extern cl_int aes128drbg_fill(aes128drbg_t* const drbg, void* out,
+  const uint64_t length);
+
+extern cl_int aes128drbg_fill_fd(aes128drbg_t* const drbg, const int fd,
+  const uint64_t length, uint64_t* const written);
+
+#endif
@@ -0,0 +1,325 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes2.
+ *
+ * clayfreeman/aes2 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes2; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <tmmintrin.h>
+  #define AES128VPERM_SSSE3
+#endif
+
+#include "aes128vperm.h"
+
+#ifdef AES128VPERM_SSSE3
+/**
+ * Nibble lookup tables for computing the S-box with `pshufb`.
+ *
+ * Each byte is mapped from the AES field GF(2^8)/0x11B into the tower field
+ * GF(16)[y]/(y^2 + y + 8) over GF(16)/0x13 (sending x to 0x20), where an
+ * inverse only needs GF(16) arithmetic on its two nibbles.  Products of two
+ * nibbles are taken in the log domain (base 2) so that every step is a
+ * 16-entry lookup; the log of zero is 0xC0 so that any sum involving it keeps
+ * its top bit set and `pshufb` yields zero.  The final tables fold the map
+ * back into the AES field together with the affine transform (the constant
+ * 0x63 is folded into the round keys instead).
+ */
+static const unsigned char aes128vperm_tables[][16] = {
+  // High nibble of the tower field image, indexed by the input's low nibble
+  { 0x00, 0x00, 0x02, 0x02, 0x04, 0x04, 0x06, 0x06,
+    0x04, 0x04, 0x06, 0x06, 0x00, 0x00, 0x02, 0x02 },
+  // High nibble of the tower field image, indexed by the input's high nibble
+  { 0x00, 0x03, 0x0D, 0x0E, 0x03, 0x00, 0x0E, 0x0D,
+    0x0E, 0x0D, 0x03, 0x00, 0x0D, 0x0E, 0x00, 0x03 },
+  // Low nibble of the tower field image, indexed by the input's low nibble
+  { 0x00, 0x01, 0x00, 0x01, 0x06, 0x07, 0x06, 0x07,
+    0x0C, 0x0D, 0x0C, 0x0D, 0x0A, 0x0B, 0x0A, 0x0B },
+  // Low nibble of the tower field image, indexed by the input's high nibble
+  { 0x00, 0x0C, 0x05, 0x09, 0x04, 0x08, 0x01, 0x0D,
+    0x05, 0x09, 0x00, 0x0C, 0x01, 0x0D, 0x04, 0x08 },
+  // log(n)
+  { 0xC0, 0x00, 0x01, 0x04, 0x02, 0x08, 0x05, 0x0A,
+    0x03, 0x0E, 0x09, 0x07, 0x06, 0x0D, 0x0B, 0x0C },
+  // log(1 / n)
+  { 0xC0, 0x00, 0x0E, 0x0B, 0x0D, 0x07, 0x0A, 0x05,
+    0x0C, 0x01, 0x06, 0x08, 0x09, 0x02, 0x04, 0x03 },
+  // exp(n)
+  { 0x01, 0x02, 0x04, 0x08, 0x03, 0x06, 0x0C, 0x0B,
+    0x05, 0x0A, 0x07, 0x0E, 0x0F, 0x0D, 0x09, 0x00 },
+  // 8 * n^2
+  { 0x00, 0x08, 0x06, 0x0E, 0x0B, 0x03, 0x0D, 0x05,
+    0x0A, 0x02, 0x0C, 0x04, 0x01, 0x09, 0x07, 0x0F },
+  // n^2
+  { 0x00, 0x01, 0x04, 0x05, 0x03, 0x02, 0x07, 0x06,
+    0x0C, 0x0D, 0x08, 0x09, 0x0F, 0x0E, 0x0B, 0x0A },
+  // Affine transform of the inverse's high nibble exp(n), back in GF(2^8)
+  { 0x52, 0x3E, 0x65, 0x60, 0x6C, 0x5B, 0x05, 0x0C,
+    0x37, 0x5E, 0x09, 0x3B, 0x69, 0x57, 0x32, 0x00 },
+  // Affine transform of the inverse's low nibble exp(n), back in GF(2^8)
+  { 0x1F, 0xB2, 0xAB, 0x36, 0xAD, 0x19, 0x9D, 0x9B,
+    0xB4, 0x84, 0x06, 0x2F, 0x30, 0x82, 0x29, 0x00 },
+  // ShiftRows
+  { 0x00, 0x05, 0x0A, 0x0F, 0x04, 0x09, 0x0E, 0x03,
+    0x08, 0x0D, 0x02, 0x07, 0x0C, 0x01, 0x06, 0x0B },
+  // Rotate each column by one byte
+  { 0x01, 0x02, 0x03, 0x00, 0x05, 0x06, 0x07, 0x04,
+    0x09, 0x0A, 0x0B, 0x08, 0x0D, 0x0E, 0x0F, 0x0C },
+  // Rotate each column by two bytes
+  { 0x02, 0x03, 0x00, 0x01, 0x06, 0x07, 0x04, 0x05,
+    0x0A, 0x0B, 0x08, 0x09, 0x0E, 0x0F, 0x0C, 0x0D }
+};
+
+typedef struct {
+  __m128i  ph_lo, ph_hi; // The tower field image's high nibble
+  __m128i  pl_lo, pl_hi; // The tower field image's low nibble
+  __m128i   log, loginv; // Logarithms of a nibble and of its inverse
+  __m128i           exp; // Exponentials of a logarithm
+  __m128i      sql,  sq; // 8 * n^2 and n^2
+  __m128i  qh,       ql; // The output maps of the inverse's nibbles
+  __m128i  sr, rot1, rot2; // ShiftRows and the MixColumns rotations
+  __m128i   nibble, mod; // The constants 0x0F and 15 in every byte
+  __m128i          poly; // The reduction constant 0x1B in every byte
+} aes128vperm_consts_t;
+
+/**
+ * Adds two logarithms modulo 15, leaving the top bit set if either was the
+ * logarithm of zero.
+ *
+ * @param   a  The first logarithm.
+ * @param   b  The second logarithm.
+ * @param   c  The lookup constants.
+ *
+ * @return     The sum of the logarithms.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i aes128vperm_log_add(const __m128i a, const __m128i b,
+    const aes128vperm_consts_t* const c) {
+  // Saturate the sum so that zero's logarithm cannot wrap back around
+  __m128i s = _mm_adds_epu8(a, b);
+  // Subtract 15 from every sum that is at least 15
+  return _mm_min_epu8(s, _mm_sub_epi8(s, c->mod));
+}
+
+/**
+ * Substitutes every byte of a state with the S-box (without its constant)
+ * using only nibble lookups.
+ *
+ * @param   x  The state to be substituted.
+ * @param   c  The lookup constants.
+ *
+ * @return     The substituted state.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i aes128vperm_sub_bytes(const __m128i x,
+    const aes128vperm_consts_t* const c) {
+  // Split each byte into its nibbles
+  __m128i lo = _mm_and_si128(x, c->nibble);
+  __m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), c->nibble);
+  // Map each byte into the tower field as h * y + l
+  __m128i h  = _mm_xor_si128(_mm_shuffle_epi8(c->ph_lo, lo),
+                             _mm_shuffle_epi8(c->ph_hi, hi));
+  __m128i l  = _mm_xor_si128(_mm_shuffle_epi8(c->pl_lo, lo),
+                             _mm_shuffle_epi8(c->pl_hi, hi));
+  // Compute the norm d = 8 * h^2 + h * l + l^2
+  __m128i lh = _mm_shuffle_epi8(c->log, h);
+  __m128i hl = _mm_shuffle_epi8(c->exp, aes128vperm_log_add(lh,
+    _mm_shuffle_epi8(c->log, l), c));
+  __m128i d  = _mm_xor_si128(hl, _mm_xor_si128(_mm_shuffle_epi8(c->sql, h),
+                                               _mm_shuffle_epi8(c->sq,  l)));
+  // The inverse is (h / d) * y + (h + l) / d
+  __m128i ld = _mm_shuffle_epi8(c->loginv, d);
+  __m128i lx = _mm_shuffle_epi8(c->log, _mm_xor_si128(h, l));
+  // Map both nibbles of the inverse back and apply the affine transform
+  return _mm_xor_si128(
+    _mm_shuffle_epi8(c->qh, aes128vperm_log_add(lh, ld, c)),
+    _mm_shuffle_epi8(c->ql, aes128vperm_log_add(lx, ld, c)));
+}
+
+/**
+ * Mixes each column of a state.
+ *
+ * @param   x  The state to be mixed.
+ * @param   c  The lookup constants.
+ *
+ * @return     The mixed state.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i aes128vperm_mix_columns(const __m128i x,
+    const aes128vperm_consts_t* const c) {
+  // Multiply every byte by two, reducing those that overflow
+  __m128i x2 = _mm_xor_si128(_mm_add_epi8(x, x), _mm_and_si128(c->poly,
+    _mm_cmplt_epi8(x, _mm_setzero_si128())));
+  // out[i] = 2 * x[i] + 3 * x[i + 1] + x[i + 2] + x[i + 3]
+  __m128i t  = _mm_xor_si128(x, _mm_shuffle_epi8(x, c->rot1));
+  return _mm_xor_si128(_mm_xor_si128(x2, _mm_shuffle_epi8(x2, c->rot1)),
+    _mm_xor_si128(_mm_shuffle_epi8(t, c->rot2),
+                  _mm_shuffle_epi8(x, c->rot1)));
+}
+
+/**
+ * Encrypts a group of consecutive counter blocks.
+ *
+ * @param  context  The context holding the converted key schedule.
+ * @param  c        The lookup constants.
+ * @param  index    The block index of the first counter.
+ * @param  out      The resulting key stream blocks.
+ */
+__attribute__((target("ssse3")))
+static inline void aes128vperm_encrypt_counters(
+    const aes128vperm_context_t* const context,
+    const aes128vperm_consts_t* const c, const uint64_t index,
+    __m128i out[AES128VPERM_WAYS]) {
+  uint64_t nonce;
+  memcpy(&nonce, context->nonce.val, sizeof(nonce));
+  // Build each counter from the nonce and the big-endian block index
+  __m128i k = _mm_loadu_si128((const __m128i*)context->key.val);
+  for (int j = 0; j < AES128VPERM_WAYS; ++j)
+    out[j] = _mm_xor_si128(k, _mm_set_epi64x(
+      (long long)__builtin_bswap64(index + j), (long long)nonce));
+  // Run the rounds side by side on each block
+  for (int r = 1; r <= 10; ++r) {
+    k = _mm_loadu_si128((const __m128i*)(context->key.val + (r << 4)));
+    for (int j = 0; j < AES128VPERM_WAYS; ++j) {
+      // ShiftRows commutes with SubBytes, so it is applied first
+      __m128i x = aes128vperm_sub_bytes(_mm_shuffle_epi8(out[j], c->sr), c);
+      if (r < 10) x = aes128vperm_mix_columns(x, c);
+      out[j] = _mm_xor_si128(x, k);
+    }
+  }
+}
+
+/**
+ * Crypts a number of blocks in place using SSSE3.
+ *
+ * @param   context  The AES128 vector-permute context used for cryption.
+ * @param   data     The blocks to be crypted in place.
+ * @param   count    The number of blocks to be crypted.
+ */
+__attribute__((target("ssse3")))
+void aes128vperm_crypt_ssse3(aes128vperm_context_t* const context,
+    aes128_state_t* data, uint64_t count) {
+  const unsigned char (*t)[16] = aes128vperm_tables;
+  const aes128vperm_consts_t c = {
+    .ph_lo  = _mm_loadu_si128((const __m128i*)t[ 0]),
+    .ph_hi  = _mm_loadu_si128((const __m128i*)t[ 1]),
+    .pl_lo  = _mm_loadu_si128((const __m128i*)t[ 2]),
+    .pl_hi  = _mm_loadu_si128((const __m128i*)t[ 3]),
+    .log    = _mm_loadu_si128((const __m128i*)t[ 4]),
+    .loginv = _mm_loadu_si128((const __m128i*)t[ 5]),
+    .exp    = _mm_loadu_si128((const __m128i*)t[ 6]),
+    .sql    = _mm_loadu_si128((const __m128i*)t[ 7]),
+    .sq     = _mm_loadu_si128((const __m128i*)t[ 8]),
+    .qh     = _mm_loadu_si128((const __m128i*)t[ 9]),
+    .ql     = _mm_loadu_si128((const __m128i*)t[10]),
+    .sr     = _mm_loadu_si128((const __m128i*)t[11]),
+    .rot1   = _mm_loadu_si128((const __m128i*)t[12]),
+    .rot2   = _mm_loadu_si128((const __m128i*)t[13]),
+    .nibble = _mm_set1_epi8(0x0F),
+    .mod    = _mm_set1_epi8(15),
+    .poly   = _mm_set1_epi8(0x1B)
+  };
+  __m128i ks[AES128VPERM_WAYS];
+  // Crypt each whole group of blocks directly in the caller's buffer
+  for (; count >= AES128VPERM_WAYS; count -= AES128VPERM_WAYS,
+      data += AES128VPERM_WAYS, context->index += AES128VPERM_WAYS) {
+    aes128vperm_encrypt_counters(context, &c, context->index, ks);
+    for (int j = 0; j < AES128VPERM_WAYS; ++j)
+      _mm_storeu_si128((__m128i*)data[j].val, _mm_xor_si128(ks[j],
+        _mm_loadu_si128((const __m128i*)data[j].val)));
+  }
+  // Crypt any remaining blocks using part of one more group
+  if (count > 0) {
+    aes128vperm_encrypt_counters(context, &c, context->index, ks);
+    for (uint64_t j = 0; j < count; ++j)
+      _mm_storeu_si128((__m128i*)data[j].val, _mm_xor_si128(ks[j],
+        _mm_loadu_si128((const __m128i*)data[j].val)));
+    context->index += count;
+  }
+  // Zero-initialize the key stream for security
+  aes128_wipe(ks, sizeof(ks));
+}
+#endif
+
+/**
+ * Determines whether the running CPU can use the vector-permute engine.
+ *
+ * @return  1 if the engine is supported, otherwise 0.
+ */
+int aes128vperm_supported(void) {
+  #ifdef AES128VPERM_SSSE3
+  return __builtin_cpu_supports("ssse3") ? 1 : 0;
+  #else
+  return 0;
+  #endif
+}
+
+/**
+ * Initializes a vector-permute CTR context from an expanded key schedule.
+ *
+ * The S-box's additive constant commutes with ShiftRows and MixColumns, so it
+ * is folded into every round key after the first here rather than being
+ * applied to each block in every round.
+ *
+ * @param  context  The context to be initialized.
+ * @param  key      The expanded key schedule to use for cryption.
+ * @param  nonce    The nonce to use for cryption.
+ */
+void aes128vperm_init(aes128vperm_context_t* const context,
+    const aes128_key_t* const key, const aes128_nonce_t* const nonce) {
+  // Copy the key schedule and fold the S-box constant into rounds 1 to 10
+  memcpy(context->key.val, key->val, sizeof(key->val));
+  for (size_t i = 16; i < sizeof(context->key.val); ++i)
+    context->key.val[i] ^= 0x63;
+  memcpy(context->nonce.val, nonce->val, sizeof(nonce->val));
+  context->index = 0;
+}
+
+/**
+ * Zero-initializes a vector-permute CTR context for security.
+ *
+ * @param  context  The context to be destroyed.
+ */
+void aes128vperm_destroy(aes128vperm_context_t* const context) {
+  aes128_wipe(context, sizeof(*context));
+}
+
+/**
+ * Crypts a number of blocks in place, starting at the context's current block
+ * index.
+ *
+ * Every step runs in constant time without any secret-dependent memory access.
+ *
+ * @param   context  The AES128 vector-permute context used for cryption.
+ * @param   data     The blocks to be crypted in place.
+ * @param   count    The number of blocks to be crypted.
+ *
+ * @return           The number of blocks that were crypted (zero when the CPU
+ *                   is not supported).
+ */
+uint64_t aes128vperm_crypt_blocks(aes128vperm_context_t* const context,
+    aes128_state_t* data, uint64_t count) {
+  #ifdef AES128VPERM_SSSE3
+  if (aes128vperm_supported()) {
+    aes128vperm_crypt_ssse3(context, data, count);
+    return count;
+  }
+  #endif
+  (void)context; (void)data;
+  return 0;
+}
@@ -0,0 +1,48 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes2.
+ *
+ * clayfreeman/aes2 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes2; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AES128VPERM_H
+#define __AES128VPERM_H
+
+#include <stdint.h>
+
+#include "aes128.h"
+
+/**
+ * The number of blocks crypted side by side to hide instruction latency.
+ */
+#define AES128VPERM_WAYS 4
+
+typedef struct {
+  aes128_key_t      key; // The key schedule with the S-box constant folded in
+  aes128_nonce_t  nonce; // The nonce forming the top half of each counter
+  uint64_t        index; // The block index used for the next cryption
+} aes128vperm_context_t;
+
+extern int aes128vperm_supported(void);
+
+extern void aes128vperm_init(aes128vperm_context_t* const context,
+  const aes128_key_t* const key, const aes128_nonce_t* const nonce);
+
+extern void aes128vperm_destroy(aes128vperm_context_t* const context);
+
+extern uint64_t aes128vperm_crypt_blocks(aes128vperm_context_t* const context,
+  aes128_state_t* data, uint64_t count);
+
+#endif
@@ -0,0 +1,182 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes2.
+ *
+ * clayfreeman/aes2 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes2; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "aes128.h"
+#include "aes2client.h"
+#include "aes2proto.h"
+
+/**
+ * Connects to an encryption daemon listening on a Unix domain socket.
+ *
+ * @param   client  The client to be connected.
+ * @param   path    The filesystem path of the daemon's socket.
+ *
+ * @return          0 on success, or -1 on failure (with `errno` set).
+ */
+int aes2client_connect(aes2client_t* const client, const char* path) {
+  struct sockaddr_un addr;
+  // Ensure that the path fits in a socket address
+  memset(&addr, 0, sizeof(addr));
+  if (strlen(path) >= sizeof(addr.sun_path)) { errno = ENAMETOOLONG; return -1; }
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  // Attempt to create a socket and connect it to the daemon
+  if ((client->sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+  if (connect(client->sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    int error = errno; close(client->sock); client->sock = -1; errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Disconnects from an encryption daemon.
+ *
+ * @param  client  The client to be disconnected.
+ */
+void aes2client_close(aes2client_t* const client) {
+  if (client->sock >= 0) close(client->sock);
+  client->sock = -1;
+}
+
+/**
+ * Creates an anonymous shared-memory segment that can be handed to the daemon.
+ *
+ * @param   segment  An output parameter used to store the segment.
+ * @param   size     The size of the segment in bytes.
+ *
+ * @return           0 on success, or -1 on failure (with `errno` set).
+ */
+int aes2client_segment_create(aes2client_segment_t* const segment,
+    const size_t size) {
+  memset(segment, 0, sizeof(*segment));
+  #ifdef __linux__
+  // Create an anonymous memory-backed file that can be sealed
+  segment->fd = memfd_create("aes2", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  #else
+  // Create a uniquely named POSIX shared-memory object and unlink it at once
+  char name[32];
+  snprintf(name, sizeof(name), "/aes2.%ld", (long)getpid());
+  segment->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (segment->fd >= 0) shm_unlink(name);
+  #endif
+  if (segment->fd < 0) return -1;
+  // Size the segment and map it into this process
+  if (ftruncate(segment->fd, size) != 0 ||
+      #ifdef __linux__
+      // Forbid shrinking, which the daemon requires of every segment
+      fcntl(segment->fd, F_ADD_SEALS, F_SEAL_SHRINK) != 0 ||
+      #endif
+      (segment->ptr = (unsigned char*)mmap(NULL, size,
+        PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0)) == MAP_FAILED) {
+    int error = errno; close(segment->fd); errno = error;
+    memset(segment, 0, sizeof(*segment)); segment->fd = -1;
+    return -1;
+  }
+  segment->size = size;
+  return 0;
+}
+
+/**
+ * Unmaps and closes a shared-memory segment.
+ *
+ * @param  segment  The segment to be destroyed.
+ */
+void aes2client_segment_destroy(aes2client_segment_t* const segment) {
+  if (segment->ptr != NULL) munmap(segment->ptr, segment->size);
+  if (segment->fd  >= 0)    close(segment->fd);
+  memset(segment, 0, sizeof(*segment));
+  segment->fd = -1;
+}
+
+/**
+ * Asks the daemon to crypt part of a shared-memory segment in place, and waits
+ * for it to finish.
+ *
+ * @param   client   The client connected to the daemon.
+ * @param   segment  The segment containing the payload.
+ * @param   offset   The byte offset of the payload within the segment.
+ * @param   length   The number of payload bytes to crypt.
+ * @param   key      The raw 128-bit key.
+ * @param   nonce    The 64-bit nonce used for the CTR block cipher mode.
+ * @param   index    The block index at which cryption begins.
+ *
+ * @return           0 on success, -1 on a transport failure (with `errno`
+ *                   set), or the daemon's non-zero status code.
+ */
+int aes2client_crypt(aes2client_t* const client,
+    const aes2client_segment_t* const segment, const uint64_t offset,
+    const uint64_t length, const unsigned char key[16],
+    const unsigned char nonce[8], const uint64_t index) {
+  union {
+    char             buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  aes2d_request_t  request;
+  aes2d_response_t response;
+  struct iovec     iov = { &request, sizeof(request) };
+  struct msghdr    msg;
+  struct cmsghdr*   cm = NULL;
+  // Describe the payload without including any of it
+  memset(&request, 0, sizeof(request));
+  request.magic  = AES2D_MAGIC;
+  request.index  = index;
+  request.offset = offset;
+  request.length = length;
+  memcpy(request.key,   key,   sizeof(request.key));
+  memcpy(request.nonce, nonce, sizeof(request.nonce));
+  // Attach the segment's file descriptor as ancillary data
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  cm                 = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level     = SOL_SOCKET;
+  cm->cmsg_type      = SCM_RIGHTS;
+  cm->cmsg_len       = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cm), &segment->fd, sizeof(int));
+  ssize_t sent = sendmsg(client->sock, &msg, 0);
+  // Zero-initialize the request for security
+  aes128_wipe(&request, sizeof(request));
+  if (sent != (ssize_t)sizeof(request)) {
+    if (sent >= 0) errno = EPROTO;
+    return -1;
+  }
+  // Wait for the daemon to finish crypting the payload in place
+  if (recv(client->sock, &response, sizeof(response), MSG_WAITALL) !=
+      (ssize_t)sizeof(response) || response.magic != AES2D_MAGIC) {
+    errno = EPROTO;
+    return -1;
+  }
+  return response.status;
+}
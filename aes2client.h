@@ -0,0 +1,50 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes2.
+ *
+ * clayfreeman/aes2 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes2; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AES2CLIENT_H
+#define __AES2CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  int              sock; // The connection to the daemon's socket
+} aes2client_t;
+
+typedef struct {
+  int                fd; // The file descriptor of the shared-memory segment
+  unsigned char*    ptr; // The segment mapped into this process
+  size_t           size; // The size of the segment
+} aes2client_segment_t;
+
+extern int aes2client_connect(aes2client_t* const client, const char* path);
+
+extern void aes2client_close(aes2client_t* const client);
+
+extern int aes2client_segment_create(aes2client_segment_t* const segment,
+  const size_t size);
+
+extern void aes2client_segment_destroy(aes2client_segment_t* const segment);
+
+extern int aes2client_crypt(aes2client_t* const client,
+  const aes2client_segment_t* const segment, const uint64_t offset,
+  const uint64_t length, const unsigned char key[16],
+  const unsigned char nonce[8], const uint64_t index);
+
+#endif
@@ -0,0 +1,254 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes2.
+ *
+ * clayfreeman/aes2 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes2; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "aes128.h"
+#include "aes128ctr.h"
+#include "aes2d.h"
+
+#define AES2D_CLIENTS (64)
+
+static volatile sig_atomic_t aes2d_running = 1;
+
+/**
+ * Requests that the daemon's event loop exits (used as a signal handler).
+ *
+ * @param  signum  The signal number that was received.
+ */
+void aes2d_stop(int signum) {
+  (void)signum;
+  aes2d_running = 0;
+}
+
+/**
+ * Receives a request and the shared-memory segment sent with it.
+ *
+ * @param   sock     The client socket from which to receive the request.
+ * @param   request  An output parameter used to store the request.
+ * @param   fd       An output parameter used to store the segment's file
+ *                   descriptor (or -1 if none was sent).
+ *
+ * @return           1 if a request was received, 0 if the client hung up, or
+ *                   -1 on failure (with `errno` set).
+ */
+int aes2d_recv(const int sock, aes2d_request_t* const request, int* const fd) {
+  union {
+    char             buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec   iov = { request, sizeof(*request) };
+  struct msghdr  msg;
+  struct cmsghdr* cm = NULL;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  (*fd) = -1;
+  // Attempt to receive the request and any ancillary data sent with it
+  ssize_t length = recvmsg(sock, &msg, 0);
+  if (length <= 0) return (int)length;
+  // Extract the segment's file descriptor (if one was sent)
+  for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+      memcpy(fd, CMSG_DATA(cm), sizeof(*fd));
+  // Requests must arrive in a single message
+  if ((size_t)length != sizeof(*request)) { errno = EPROTO; return -1; }
+  return 1;
+}
+
+/**
+ * Crypts the payload described by a request in place.
+ *
+ * @param   context  The resident AES128 CTR context used for cryption.
+ * @param   current  The raw key followed by the nonce (24 bytes) that the
+ *                   context is currently keyed with (updated when the
+ *                   request uses a different one).
+ * @param   keyed    Whether `current` holds a valid key and nonce.
+ * @param   request  The request to be completed.
+ * @param   fd       The file descriptor of the request's segment.
+ * @param   length   An output parameter used to store the crypted length.
+ *
+ * @return           0 on success, an `errno` value, or an OpenCL error code.
+ */
+int aes2d_crypt(aes128ctr_context_t* const context,
+    unsigned char* const current, int* const keyed,
+    const aes2d_request_t* const request, const int fd,
+    uint64_t* const length) {
+  struct stat      st;
+  aes128_state_t tail;
+  (*length) = 0;
+  // Validate the request against its segment
+  if (request->magic != AES2D_MAGIC || request->reserved != 0) return EPROTO;
+  if (fd < 0)                                                  return EBADF;
+  #ifdef F_GET_SEALS
+  // Only map segments that can't shrink, since touching pages cut off from a
+  // mapping would kill the daemon (and every client) with `SIGBUS`
+  int seals = fcntl(fd, F_GET_SEALS);
+  if (seals < 0 || (seals & F_SEAL_SHRINK) == 0)               return EPERM;
+  #endif
+  if (fstat(fd, &st) != 0)                                     return errno;
+  if (request->offset > (uint64_t)st.st_size ||
+      request->length > (uint64_t)st.st_size - request->offset) return EINVAL;
+  if (request->length == 0)                                    return 0;
+  // Rekey the context only if this request uses a different key or nonce
+  // (`current` holds the key followed by the nonce)
+  if (!(*keyed) || memcmp(current, request->key, sizeof(request->key)) != 0 ||
+      memcmp(current + sizeof(request->key), request->nonce,
+        sizeof(request->nonce)) != 0) {
+    aes128_key_t     key;
+    aes128_nonce_t nonce;
+    memcpy(key.val,   request->key,   sizeof(request->key));
+    memcpy(nonce.val, request->nonce, sizeof(request->nonce));
+    aes128_key_init(&key);
+    cl_int status = aes128ctr_rekey(context, &key, &nonce);
+    // Zero-initialize the nonce and key for security
+    aes128_wipe(nonce.val, sizeof(nonce.val));
+    aes128_wipe(  key.val, sizeof(  key.val));
+    if (status != CL_SUCCESS) { (*keyed) = 0; return status; }
+    memcpy(current, request->key, sizeof(request->key));
+    memcpy(current + sizeof(request->key), request->nonce,
+      sizeof(request->nonce));
+    (*keyed) = 1;
+  }
+  // Map the payload, starting from the page containing its first byte
+  const uint64_t page  = (uint64_t)sysconf(_SC_PAGESIZE);
+  const uint64_t delta = request->offset & (page - 1);
+  unsigned char* base  = (unsigned char*)mmap(NULL, delta + request->length,
+    PROT_READ | PROT_WRITE, MAP_SHARED, fd, request->offset - delta);
+  if (base == MAP_FAILED) return errno;
+  unsigned char* data  = base + delta;
+  // Crypt all complete blocks directly in the segment
+  const uint64_t blocks = request->length >> 4;
+  context->index = request->index;
+  if (aes128ctr_crypt_blocks(context, (aes128_state_t*)data, blocks) == blocks)
+    (*length) = blocks << 4;
+  // Crypt any partial block through a temporary so that it can't overrun
+  if ((*length) == (blocks << 4) && (request->length & 15) > 0) {
+    memset(&tail, 0, sizeof(tail));
+    memcpy(tail.val, data + (*length), request->length & 15);
+    if (aes128ctr_crypt_blocks(context, &tail, 1) == 1) {
+      memcpy(data + (*length), tail.val, request->length & 15);
+      (*length) = request->length;
+    }
+    memset(&tail, 0, sizeof(tail));
+  }
+  munmap(base, delta + request->length);
+  return (*length) == request->length ? 0 : EIO;
+}
+
+/**
+ * Serves cryption requests on a Unix domain socket until interrupted.
+ *
+ * The context stays resident for the daemon's lifetime, so clients only pay a
+ * socket round trip per request instead of OpenCL initialization and a program
+ * build. Requests are completed one at a time in the order they are received.
+ *
+ * @param   path     The filesystem path at which to listen.
+ * @param   context  The initialized AES128 CTR context used for cryption.
+ *
+ * @return           0 on a clean shutdown, or -1 on failure (with `errno`
+ *                   set).
+ */
+int aes2d_serve(const char* path, aes128ctr_context_t* const context) {
+  struct sockaddr_un addr;
+  struct sigaction   stop;
+  struct pollfd      fds[AES2D_CLIENTS + 1];
+  nfds_t             count = 1;
+  unsigned char current[24];
+  int             keyed = 0;
+  // Ensure that the path fits in a socket address
+  memset(&addr, 0, sizeof(addr));
+  if (strlen(path) >= sizeof(addr.sun_path)) { errno = ENAMETOOLONG; return -1; }
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  // Attempt to create, bind and listen on the socket
+  fds[0].fd     = socket(AF_UNIX, SOCK_STREAM, 0);
+  fds[0].events = POLLIN;
+  if (fds[0].fd < 0) return -1;
+  unlink(path);
+  if (bind(fds[0].fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(fds[0].fd, SOMAXCONN) != 0) {
+    int error = errno; close(fds[0].fd); errno = error;
+    return -1;
+  }
+  // Exit cleanly on SIGINT/SIGTERM and survive clients that hang up early
+  memset(&stop, 0, sizeof(stop));
+  stop.sa_handler = aes2d_stop;
+  sigaction(SIGINT,  &stop, NULL);
+  sigaction(SIGTERM, &stop, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  while (aes2d_running) {
+    if (poll(fds, count, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    // Accept a new client if there is room for it
+    if (fds[0].revents & POLLIN) {
+      int client = accept(fds[0].fd, NULL, NULL);
+      if (client >= 0 && count <= AES2D_CLIENTS) {
+        fds[count].fd       = client;
+        fds[count].events   = POLLIN;
+        fds[count++].revents = 0;
+      } else if (client >= 0) {
+        close(client);
+      }
+    }
+    // Complete a request from each client that has one pending
+    for (nfds_t i = 1; i < count; ++i) {
+      if (fds[i].revents == 0) continue;
+      aes2d_request_t  request;
+      aes2d_response_t response = { AES2D_MAGIC, 0, 0 };
+      int fd = -1, received = aes2d_recv(fds[i].fd, &request, &fd);
+      if (received > 0) {
+        response.status = aes2d_crypt(context, current, &keyed,
+          &request, fd, &response.length);
+      }
+      // Zero-initialize the request for security
+      aes128_wipe(&request, sizeof(request));
+      if (fd >= 0) close(fd);
+      // Drop the client if it hung up or its reply can't be delivered
+      if (received <= 0 || send(fds[i].fd, &response, sizeof(response), 0) !=
+          (ssize_t)sizeof(response)) {
+        close(fds[i].fd);
+        fds[i--] = fds[--count];
+      }
+    }
+  }
+  // Close all connections and remove the socket
+  for (nfds_t i = 0; i < count; ++i) close(fds[i].fd);
+  unlink(path);
+  // Zero-initialize the nonce and key for security
+  aes128_wipe(current, sizeof(current));
+  return 0;
+}
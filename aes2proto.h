@@ -0,0 +1,55 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes2.
+ *
+ * clayfreeman/aes2 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes2; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AES2PROTO_H
+#define __AES2PROTO_H
+
+#include <stdint.h>
+
+#define AES2D_MAGIC (0x41455332) // "AES2"
+
+/**
+ * A request to crypt part of a shared-memory segment in place.
+ *
+ * Each request is sent over the daemon's Unix domain socket together with the
+ * segment's file descriptor (as `SCM_RIGHTS` ancillary data); the payload
+ * itself never crosses the socket. On Linux the segment must be a memfd
+ * sealed with `F_SEAL_SHRINK`, so that it can't be shrunk while the daemon
+ * has it mapped.
+ */
+typedef struct {
+  uint32_t          magic; // Always `AES2D_MAGIC`
+  uint32_t       reserved; // Must be zero
+  unsigned char   key[16]; // The raw (unexpanded) 128-bit key
+  unsigned char  nonce[8]; // The 64-bit nonce used for CTR mode
+  uint64_t          index; // The block index at which cryption begins
+  uint64_t         offset; // The byte offset of the payload within the segment
+  uint64_t         length; // The number of payload bytes to crypt
+} aes2d_request_t;
+
+/**
+ * The daemon's reply once a request has been completed (or rejected).
+ */
+typedef struct {
+  uint32_t          magic; // Always `AES2D_MAGIC`
+  int32_t          status; // 0 on success, or an `errno` value / OpenCL error
+  uint64_t         length; // The number of bytes crypted in place
+} aes2d_response_t;
+
+#endif
@@ -0,0 +1,100 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes2.
+ *
+ * clayfreeman/aes2 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes2; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aes.h"
+#include "aes128.h"
+#include "aes2client.h"
+
+/**
+ * An example client that asks a running daemon (`main daemon ...`) to crypt a
+ * file in place, using a shared-memory segment to hold the file's contents.
+ */
+int main(int argc, char* argv[]) {
+  aes2client_t         client;
+  aes2client_segment_t segment = { -1, NULL, 0 };
+  unsigned char key[16], nonce[8];
+  FILE*  fp = NULL;
+  long size = 0;
+  int  code = 0;
+
+  // Ensure that the required number of arguments was provided
+  if (argc < 5 || strlen(argv[3]) != 32 || strlen(argv[4]) != 16) {
+    fprintf(stderr, "Usage: %s <socket> <file> <key> <nonce>\n"
+      "  * socket is the path of the daemon's socket\n"
+      "  * file   is a file path to in-place (de|en)crypt\n"
+      "  * key    is a 128-bit hexadecimal value\n"
+      "  * nonce  is a  64-bit hexadecimal value\n", argc > 0 ? argv[0] : "");
+    return 1;
+  }
+
+  // Attempt to read the low portion of the key first, then its high portion
+  { uint64_t tmp = htonll(strtoull(argv[3] + 16, NULL, 16));
+  memcpy(key + 8, &tmp, 8); argv[3][16] = 0;
+  tmp = htonll(strtoull(argv[3], NULL, 16)); memcpy(key, &tmp, 8);
+  tmp = htonll(strtoull(argv[4], NULL, 16)); memcpy(nonce, &tmp, 8);
+  aes128_wipe(&tmp, sizeof(tmp)); }
+
+  // Read the file into a new shared-memory segment
+  if ((fp = fopen(argv[2], "r+b")) == NULL) {
+    perror("file: fopen()");
+    code = 2; goto cleanup;
+  }
+  fseek(fp, 0, SEEK_END); size = ftell(fp); fseek(fp, 0, SEEK_SET);
+  if (aes2client_segment_create(&segment, size > 0 ? size : 1) != 0) {
+    perror("segment: aes2client_segment_create()");
+    code = 3; goto cleanup;
+  }
+  if (fread(segment.ptr, 1, size, fp) != (size_t)size) {
+    perror("file: fread()");
+    code = 4; goto cleanup;
+  }
+
+  // Ask the daemon to crypt the segment in place
+  if (aes2client_connect(&client, argv[1]) != 0) {
+    perror("socket: aes2client_connect()");
+    code = 5; goto cleanup;
+  }
+  int status = aes2client_crypt(&client, &segment, 0, size, key, nonce, 0);
+  aes2client_close(&client);
+  if (status != 0) {
+    fprintf(stderr, "error: Cryption failed (%d)\n",
+      status < 0 ? errno : status);
+    code = 6; goto cleanup;
+  }
+
+  // Write the results back to the file
+  fseek(fp, 0, SEEK_SET);
+  if (fwrite(segment.ptr, 1, size, fp) != (size_t)size) {
+    perror("file: fwrite()");
+    code = 7; goto cleanup;
+  }
+
+cleanup:
+  // Zero-initialize the nonce and key for security
+  aes128_wipe(nonce, sizeof(nonce));
+  aes128_wipe(  key, sizeof(  key));
+  if (fp != NULL) fclose(fp);
+  aes2client_segment_destroy(&segment);
+  return code;
+}
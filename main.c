@@ -17,35 +17,141 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #define _LARGEFILE64_SOURCE
-#define _POSIX_C_SOURCE 199309L
+#define _POSIX_C_SOURCE 200809L
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 #include <OpenCL/OpenCL.h>
 
 #include "aes128.h"
 #include "aes128ctr.h"
+#include "aes128drbg.h"
+#include "aes128vperm.h"
+#include "aes2d.h"
+#include "shard.h"
+#include "staging.h"
+
+#define MIN(a,b) (a < b ? a : b)
+
+/**
+ * A gate that holds every node back until all of them have finished setting
+ * up, so that no part of the file is crypted unless every part can be.
+ */
+typedef struct {
+  pthread_mutex_t   lock; // The lock protecting the remaining fields
+  pthread_cond_t    cond; // Signalled once every node has reported
+  int              count; // The number of nodes expected to report
+  int              ready; // The number of nodes that have reported
+  int             failed; // Whether any node failed to set up
+} crypt_gate_t;
+
+/**
+ * The work of one NUMA node when a file is split across several nodes.
+ */
+typedef struct {
+  const char*           path; // The path of the file to crypt in place
+  uint64_t            device; // The zero-index of the OpenCL device
+  uint64_t             limit; // The maximum number of concurrent blocks
+  uint64_t            offset; // The byte offset of this node's part
+  uint64_t            length; // The number of bytes in this node's part
+  aes128ctr_options_t options; // The options (bound to this node)
+  int                   sync; // Whether to flush the part to disk
+  uint64_t            status; // The number of bytes that were crypted
+  int                   code; // A return code if the node failed, or 0
+  crypt_gate_t*         gate; // The gate shared by every node
+} crypt_node_t;
 
 aes128_key_t     key;
 aes128_nonce_t nonce;
 
+int  crypt_main(int argc, char* argv[], const aes128ctr_options_t* options,
+  const shard_t* shard);
+uint64_t crypt_range(aes128ctr_context_t* context, int fd, uint64_t offset,
+  uint64_t length, unsigned char* buf);
+void  crypt_gate_report(crypt_gate_t* gate, int failed);
+int   crypt_gate_wait(crypt_gate_t* gate, int failed);
+void* crypt_node_main(void* data);
+int  crypt_nodes(const char* path, uint64_t device, uint64_t limit,
+  uint64_t offset, uint64_t length, int sync,
+  const aes128ctr_options_t* options, uint64_t* status);
+int  crypt_stream(aes128ctr_context_t* context, int in, int out,
+  unsigned char* bufs[2], size_t bytes, int zerocopy, uint64_t* total);
+int  daemon_main(int argc, char* argv[]);
+int  generate_main(int argc, char* argv[]);
+int  parse_hex(const char* str, unsigned char* out, const size_t length);
+int  parse_options(int* argc, char** argv[], aes128ctr_options_t* options,
+  const char* flags);
+int  plan_main(int argc, char* argv[]);
+cl_int selftest_device_keys(uint64_t device, int* failed);
+int  selftest_host_keys(void);
+int  selftest_main(int argc, char* argv[]);
+void selftest_raw_keys(unsigned char* raw, size_t length);
+int  selftest_vperm(void);
+int  shard_main(int argc, char* argv[]);
+int  verify_main(int argc, char* argv[]);
 void print_devices();
 void timespec_diff(const struct timespec* start, struct timespec* end);
 void usage(int argc, char* argv[]);
 
 int main(int argc, char* argv[]) {
+  aes128ctr_options_t options = AES128CTR_OPTIONS_DEFAULT;
+
+  // Dispatch to a subcommand if one was named by the first argument
+  if (argc > 1 && strcmp(argv[1], "daemon") == 0) {
+    argv[1] = argv[0];
+    return daemon_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "generate") == 0) {
+    argv[1] = argv[0];
+    return generate_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "plan") == 0) {
+    argv[1] = argv[0];
+    return plan_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "selftest") == 0) {
+    argv[1] = argv[0];
+    return selftest_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "shard") == 0) {
+    argv[1] = argv[0];
+    return shard_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "verify") == 0) {
+    argv[1] = argv[0];
+    return verify_main(argc - 1, argv + 1);
+  }
+
+  // Parse any options preceding the positional arguments
+  int code = parse_options(&argc, &argv, &options, "jn:p:z");
+  if (code != 0) return code;
+
+  // Crypt the entire file
+  return crypt_main(argc, argv, &options, NULL);
+}
+
+int crypt_main(int argc, char* argv[], const aes128ctr_options_t* options,
+    const shard_t* shard) {
   FILE*        fp = NULL;
   uint64_t   size =    0;
   uint64_t device =    0;
   uint64_t  limit =    0;
+  uint64_t offset =    0;
+  int        code =    0;
 
   // Ensure that the minimum number of arguments was provided
   if (argc < 6) {
@@ -54,15 +160,34 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+  // A FILE of "-" crypts standard input to standard output instead
+  const int stream = (shard == NULL && strcmp(argv[1], "-") == 0);
+  // Output is only mapped into a pipe when streaming
+  if (!stream && options->zerocopy) {
+    fprintf(stderr, "error: -z is only supported when streaming\n");
+    usage(argc, argv);
+    return 1;
+  }
+
   errno = 0;
   // Attempt to open the FILE at the path held by the first argument
-  if ((fp = fopen(argv[1], "r+b")) == NULL) {
+  if (!stream && (fp = fopen(argv[1], "r+b")) == NULL) {
     perror("file: fopen()");
     usage(argc, argv);
     return 2;
   }
-  // Determine the size of the file
-  fseek(fp, 0, SEEK_END); size = ftell(fp); fclose(fp); fp = NULL;
+  // Determine the size of the file (or the range of the requested shard)
+  if (!stream) {
+    fseek(fp, 0, SEEK_END); size = ftell(fp); fclose(fp); fp = NULL;
+  }
+  if (shard != NULL) {
+    if (shard->offset > size || shard->length > size - shard->offset) {
+      fprintf(stderr, "error: shard lies beyond the end of the file\n");
+      return 2;
+    }
+    offset = shard->offset;
+    size   = shard->length;
+  }
 
   errno = 0;
   // Attempt to read the DEVICE held by the second argument
@@ -88,18 +213,10 @@ int main(int argc, char* argv[]) {
     usage(argc, argv);
     return 5;
   }
-  errno = 0;
-  // Attempt to read the low portion of the key first
-  { uint64_t tmp = htonll(strtoull(argv[4] + 16, NULL, 16));
-  memcpy(key.val + 8, &tmp, 8); tmp = 0; }
-  // Replace the first byte of the low portion with a NULL character
-  argv[4][16] = 0;
-  // Finally, attempt to read the high portion of the key
-  { uint64_t tmp = htonll(strtoull(argv[4],      NULL, 16));
-  memcpy(key.val,     &tmp, 8); tmp = 0; }
-  // Check for an error during either HIGH/LOW strtoull() operation
-  if (errno != 0) {
-    perror("key: strtoull()");
+  // Attempt to read the KEY held by the fourth argument
+  if (parse_hex(argv[4], key.val, 16) != 0) {
+    fprintf(stderr, "error: key must be 32 hexadecimal characters\n");
+    aes128_wipe(key.val, sizeof(key.val));
     usage(argc, argv);
     return 6;
   }
@@ -107,15 +224,15 @@ int main(int argc, char* argv[]) {
   // Ensure that the provided NONCE argument is the correct length
   if (strlen(argv[5]) != 16) {
     fprintf(stderr, "error: nonce must be 16 hexadecimal characters\n");
+    aes128_wipe(key.val, sizeof(key.val));
     usage(argc, argv);
     return 7;
   }
-  errno = 0;
   // Attempt to read the NONCE held by the fifth argument
-  { uint64_t tmp = htonll(strtoull(argv[5], NULL, 16));
-  memcpy(nonce.val, &tmp, 8); tmp = 0; }
-  if (errno != 0) {
-    perror("nonce: strtoull()");
+  if (parse_hex(argv[5], nonce.val, sizeof(nonce.val)) != 0) {
+    fprintf(stderr, "error: nonce must be 16 hexadecimal characters\n");
+    aes128_wipe(nonce.val, sizeof(nonce.val));
+    aes128_wipe(  key.val, sizeof(  key.val));
     usage(argc, argv);
     return 8;
   }
@@ -124,14 +241,61 @@ int main(int argc, char* argv[]) {
   uint64_t status = 0;
   struct timespec start = {0, 0}, end = {0, 0};
 
+  // Split the file across every requested NUMA node, each with its own
+  // buffer and engine, if more than one node was given
+  if (options->node_count > 1) {
+    if (stream) {
+      fprintf(stderr, "error: streams can only be bound to one node\n");
+      usage(argc, argv);
+      return 11;
+    }
+    aes128_key_init(&key);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Nothing is crypted unless every node was set up, so a failure code
+    // leaves the file untouched (partial cryption is reported as 127 below)
+    code = crypt_nodes(argv[1], device, limit, offset, size, shard != NULL,
+      options, &status);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    aes128ctr_jit_clear();
+    if (code != 0) {
+      aes128_wipe(nonce.val, sizeof(nonce.val));
+      aes128_wipe(  key.val, sizeof(  key.val));
+      return code;
+    }
+    goto report;
+  }
+
+  // Bind this thread to the requested NUMA node before allocating anything
+  if (staging_bind(options->node) != 0) {
+    perror("node: staging_bind()");
+    usage(argc, argv);
+    return 13;
+  }
+
   // Create a buffer used to encrypt the file contents
-  unsigned char* buf = (unsigned char*)malloc(limit << 4);
+  staging_t stage;
+  if (staging_alloc(&stage, limit << 4, options->node, options->pages) != 0) {
+    perror("buffer: staging_alloc()");
+    usage(argc, argv);
+    return 14;
+  }
+  unsigned char* buf = (unsigned char*)stage.ptr;
+  // Streams alternate between two buffers so one can stay in the output pipe
+  staging_t spare = { NULL, 0, 0 };
+  if (stream && staging_alloc(&spare, limit << 4, options->node,
+      options->pages) != 0) {
+    perror("buffer: staging_alloc()");
+    staging_free(&stage);
+    usage(argc, argv);
+    return 14;
+  }
 
   // Attempt to initialize the AES128 key
   aes128_key_init(&key);
   // Attempt to initialize the AES128 CTR context
   aes128ctr_context_t context;
-  cl_int code = aes128ctr_init(&context, device, limit, &key, &nonce);
+  code = aes128ctr_init_with_options(&context, device, limit,
+    &key, &nonce, options);
   if (code != CL_SUCCESS) {
     fprintf(stderr, "OpenCL error: %d\n", code);
     usage(argc, argv);
@@ -139,10 +303,9 @@ int main(int argc, char* argv[]) {
   }
 
   // Attempt to open the FILE at the path held by the first argument
-  FILE* ifp = NULL; FILE* ofp = NULL;
-  if ((ifp = fopen(argv[1], "rb" )) == NULL ||
-      (ofp = fopen(argv[1], "r+b")) == NULL) {
-    perror("file: fopen()");
+  int fd = -1;
+  if (!stream && (fd = open(argv[1], O_RDWR)) < 0) {
+    perror("file: open()");
     usage(argc, argv);
     return 10;
   }
@@ -150,22 +313,18 @@ int main(int argc, char* argv[]) {
   // Begin tracking time required to execute
   clock_gettime(CLOCK_MONOTONIC, &start);
 
-  while (!feof(ifp) && !ferror(ifp) && !ferror(ofp)) {
-    // Attempt to read as many blocks for this worker as max kernels
-    uint64_t  length = fread(buf, 16, limit, ifp) << 4;
-    // Check to see that the requested number of blocks could not be read
-    if (length < (limit << 4)) {
-      fseek(ifp, status + length, SEEK_SET);
-      // Attempt to read a partial block into the next block
-      uint64_t bytes = fread(buf + length, 1, 16, ifp);
-      // If we read non-zero bytes, then increment the length
-      if (bytes > 0) length += bytes;
-    }
-    // Enqueue the kernel for execution on the OpenCL device
-    aes128ctr_crypt_blocks(&context, (aes128_state_t*)buf,
-      (length >> 4) + ((length & 15) > 0 ? 1 : 0));
-    // Write the total encrypted length to the output file
-    status += fwrite(buf, 1, length, ofp);
+  if (stream) {
+    unsigned char* bufs[2] = { buf, (unsigned char*)spare.ptr };
+    // Crypt standard input to standard output until the end of the input
+    if (crypt_stream(&context, STDIN_FILENO, STDOUT_FILENO, bufs,
+        limit << 4, options->zerocopy, &status) != 0) {
+      perror("stream: crypt_stream()");
+      // Ensure that the failure is reported below
+      size = UINT64_MAX;
+    } else size = status;
+  } else {
+    // Crypt the requested range of the file in place
+    status = crypt_range(&context, fd, offset, size, buf);
   }
 
   // Finish tracking time required to execute
@@ -174,12 +333,17 @@ int main(int argc, char* argv[]) {
   // #define DEBUG
 
   // Close the provided file to flush its contents
-  fclose(ifp); fclose(ofp); ifp = ofp = NULL;
-  // Destroy the AES128 CTR context
+  if (status == size && shard != NULL && fsync(fd) != 0) status = 0;
+  if (fd >= 0) close(fd);
+  fd = -1;
+  // Destroy the AES128 CTR context and wipe any key-specialized binaries
   aes128ctr_destroy(&context);
+  aes128ctr_jit_clear();
+  // Free the spare buffer used for streaming
+  staging_free(&spare);
   #ifndef DEBUG
   // Free the buffer used for file encryption
-  free(buf);
+  staging_free(&stage);
   #endif
 
   #ifdef DEBUG
@@ -189,14 +353,15 @@ int main(int argc, char* argv[]) {
       (i == 0 ? "" : "\n") : " "), ((unsigned char*)buf)[i]);
   fprintf(stderr, "\n");
   // Free the buffer used for file encryption
-  free(buf);
+  staging_free(&stage);
   #endif
 
+report:
   timespec_diff(&start, &end);
   double duration = ((double)end.tv_sec + (end.tv_nsec / 1E9f));
   // Zero-initialize the nonce and key for security
-  memset(nonce.val, 0, sizeof(nonce.val));
-  memset(  key.val, 0, sizeof(  key.val));
+  aes128_wipe(nonce.val, sizeof(nonce.val));
+  aes128_wipe(  key.val, sizeof(  key.val));
   // Check the status of the cryption operation
   if (status != size) {
     fprintf(stderr, "error: Cryption failed\n");
@@ -209,6 +374,757 @@ int main(int argc, char* argv[]) {
   return 0;
 }
 
+uint64_t crypt_range(aes128ctr_context_t* context, int fd, uint64_t offset,
+    uint64_t length, unsigned char* buf) {
+  uint64_t status = 0;
+  // Start the key stream at the block containing the first byte
+  context->index = offset >> 4;
+  while (status < length) {
+    // Attempt to read as many blocks for this worker as max kernels
+    uint64_t bytes = MIN(context->limit << 4, length - status);
+    for (uint64_t done = 0; done < bytes; ) {
+      ssize_t result = pread(fd, buf + done, bytes - done,
+        offset + status + done);
+      if (result < 0 && errno == EINTR) continue;
+      if (result <= 0) return status;
+      done += result;
+    }
+    // Enqueue the kernel for execution on the OpenCL device, stopping before
+    // any plaintext is written back if the device fails
+    uint64_t blocks = (bytes >> 4) + ((bytes & 15) > 0 ? 1 : 0);
+    if (aes128ctr_crypt_blocks(context, (aes128_state_t*)buf, blocks) !=
+        blocks) return status;
+    // Write the encrypted blocks back in place
+    for (uint64_t done = 0; done < bytes; ) {
+      ssize_t result = pwrite(fd, buf + done, bytes - done,
+        offset + status + done);
+      if (result < 0 && errno == EINTR) continue;
+      if (result <= 0) return status + done;
+      done += result;
+    }
+    status += bytes;
+  }
+  return status;
+}
+
+void crypt_gate_report(crypt_gate_t* gate, int failed) {
+  pthread_mutex_lock(&gate->lock);
+  // Record this node's result, waking every node once all have reported
+  gate->failed |= failed;
+  if (++gate->ready == gate->count) pthread_cond_broadcast(&gate->cond);
+  pthread_mutex_unlock(&gate->lock);
+}
+
+int crypt_gate_wait(crypt_gate_t* gate, int failed) {
+  crypt_gate_report(gate, failed);
+  pthread_mutex_lock(&gate->lock);
+  // Wait for every other node to report before deciding whether to crypt
+  while (gate->ready < gate->count)
+    pthread_cond_wait(&gate->cond, &gate->lock);
+  int proceed = !gate->failed;
+  pthread_mutex_unlock(&gate->lock);
+  return proceed;
+}
+
+void* crypt_node_main(void* data) {
+  crypt_node_t* work = (crypt_node_t*)data;
+  const int     node = work->options.node;
+  staging_t    stage = { NULL, 0, 0 };
+  aes128ctr_context_t context;
+  int         inited = 0;
+  int             fd = -1;
+
+  // Bind this thread to its node before allocating anything
+  if (staging_bind(node) != 0) {
+    fprintf(stderr, "node %d: staging_bind(): %s\n", node, strerror(errno));
+    work->code = 13;
+  }
+  // Create a buffer on this node used to encrypt the node's part
+  if (work->code == 0 && staging_alloc(&stage, work->limit << 4, node,
+      work->options.pages) != 0) {
+    fprintf(stderr, "node %d: staging_alloc(): %s\n", node, strerror(errno));
+    work->code = 14;
+  }
+  // Attempt to initialize an AES128 CTR context for this node
+  if (work->code == 0) {
+    cl_int status = aes128ctr_init_with_options(&context, work->device,
+      work->limit, &key, &nonce, &work->options);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "node %d: OpenCL error: %d\n", node, status);
+      work->code = 9;
+    } else inited = 1;
+  }
+  // Each node uses its own descriptor, since `pread()` and `pwrite()` don't
+  // share a file position
+  if (work->code == 0 && (fd = open(work->path, O_RDWR)) < 0) {
+    fprintf(stderr, "node %d: open(): %s\n", node, strerror(errno));
+    work->code = 10;
+  }
+
+  // Crypt this node's part of the file in place only if every node is ready
+  if (crypt_gate_wait(work->gate, work->code != 0)) {
+    work->status = crypt_range(&context, fd, work->offset, work->length,
+      (unsigned char*)stage.ptr);
+    if (work->status == work->length && work->sync && fsync(fd) != 0)
+      work->status = 0;
+  }
+  if (fd >= 0) close(fd);
+  if (inited) aes128ctr_destroy(&context);
+  staging_free(&stage);
+  return NULL;
+}
+
+int crypt_nodes(const char* path, uint64_t device, uint64_t limit,
+    uint64_t offset, uint64_t length, int sync,
+    const aes128ctr_options_t* options, uint64_t* status) {
+  crypt_node_t work[AES128CTR_MAX_NODES];
+  pthread_t  threads[AES128CTR_MAX_NODES];
+  int        started[AES128CTR_MAX_NODES];
+  int           code = 0;
+  crypt_gate_t  gate = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    options->node_count, 0, 0 };
+  // Spread the blocks as evenly as possible, keeping each part block-aligned
+  uint64_t blocks = (length + 15) >> 4;
+  uint64_t   each = (blocks + options->node_count - 1) / options->node_count;
+  (*status) = 0;
+  for (int i = 0; i < options->node_count; ++i) {
+    uint64_t start = MIN((uint64_t)i * (each << 4), length);
+    memset(work + i, 0, sizeof(work[i]));
+    work[i].path         = path;
+    work[i].device       = device;
+    work[i].limit        = limit;
+    work[i].offset       = offset + start;
+    work[i].length       = MIN(each << 4, length - start);
+    work[i].options      = (*options);
+    work[i].options.node = options->nodes[i];
+    work[i].sync         = sync;
+    work[i].gate         = &gate;
+    started[i] = (errno = pthread_create(threads + i, NULL,
+      crypt_node_main, work + i)) == 0;
+    if (!started[i]) {
+      // Report on behalf of the missing node so that the others give up
+      perror("node: pthread_create()");
+      work[i].code = 13;
+      crypt_gate_report(&gate, 1);
+    }
+  }
+  // Wait for every node, keeping the first failure
+  for (int i = 0; i < options->node_count; ++i) {
+    if (started[i]) pthread_join(threads[i], NULL);
+    if (code == 0) code = work[i].code;
+    (*status) += work[i].status;
+  }
+  return code;
+}
+
+int crypt_stream(aes128ctr_context_t* context, int in, int out,
+    unsigned char* bufs[2], size_t bytes, int zerocopy, uint64_t* total) {
+  int splice_out = 0;
+  (*total) = 0;
+  // Start the key stream at the first block
+  context->index = 0;
+  #ifdef __linux__
+  struct stat info;
+  // Zero-copy output is only possible when writing into a pipe
+  if (zerocopy && fstat(out, &info) == 0 && S_ISFIFO(info.st_mode)) {
+    // A buffer may only be reused once every page of it has left the pipe,
+    // which is guaranteed when the other buffer alone can fill the pipe
+    int size = fcntl(out, F_GETPIPE_SZ);
+    if (size > 0 && (size_t)size > bytes)
+      size = fcntl(out, F_SETPIPE_SZ, (int)MIN(bytes, (size_t)INT32_MAX));
+    splice_out = (size > 0 && (size_t)size <= bytes);
+  }
+  #endif
+  for (int cur = 0; ; cur ^= 1) {
+    unsigned char* buf = bufs[cur];
+    size_t have = 0;
+    // Fill the batch, keeping any partial block from a short read until the
+    // rest of it arrives
+    while (have < bytes) {
+      ssize_t result = read(in, buf + have, bytes - have);
+      if (result < 0 && errno == EINTR) continue;
+      if (result < 0) return -1;
+      if (result == 0) break;
+      have += result;
+    }
+    if (have == 0) return 0;
+    // Crypt every block of the batch (including a final partial block)
+    uint64_t blocks = (have >> 4) + ((have & 15) > 0 ? 1 : 0);
+    if (aes128ctr_crypt_blocks(context, (aes128_state_t*)buf, blocks) !=
+        blocks) {
+      errno = EIO; return -1;
+    }
+    // Write the crypted batch to the output
+    for (size_t done = 0; done < have; ) {
+      ssize_t result;
+      #ifdef __linux__
+      if (splice_out) {
+        // Map the buffer's pages into the pipe rather than copying them
+        struct iovec iov = { buf + done, have - done };
+        result = vmsplice(out, &iov, 1, 0);
+      } else
+      #endif
+      result = write(out, buf + done, have - done);
+      if (result < 0 && errno == EINTR) continue;
+      if (result <= 0) return -1;
+      done += result;
+    }
+    (*total) += have;
+    // A short batch means that the end of the input was reached
+    if (have < bytes) return 0;
+  }
+}
+
+int plan_main(int argc, char* argv[]) {
+  shard_plan_t plan;
+  uint64_t    count = 0;
+
+  // Ensure that the minimum number of arguments was provided
+  if (argc < 4) {
+    fprintf(stderr, "error: Not enough arguments.\n");
+    usage(argc, argv);
+    return 1;
+  }
+
+  errno = 0;
+  // Attempt to read the number of SHARDS held by the second argument
+  count = strtoull(argv[2], NULL, 10);
+  if (errno != 0 || count == 0) {
+    fprintf(stderr, "error: shards must be a positive integer\n");
+    usage(argc, argv);
+    return 3;
+  }
+
+  // Split the file and write the plan to the manifest
+  if (shard_plan_create(&plan, argv[1], count) != 0) {
+    perror("file: shard_plan_create()");
+    usage(argc, argv);
+    return 2;
+  }
+  if (shard_plan_save(&plan, argv[3]) != 0) {
+    perror("manifest: shard_plan_save()");
+    shard_plan_free(&plan);
+    return 10;
+  }
+  for (uint64_t i = 0; i < plan.count; ++i)
+    fprintf(stderr, "shard %" PRIu64 ": offset %" PRIu64 ", length %" PRIu64
+      ", counter %" PRIu64 "\n", plan.shards[i].index, plan.shards[i].offset,
+      plan.shards[i].length, plan.shards[i].counter);
+  shard_plan_free(&plan);
+  return 0;
+}
+
+int shard_main(int argc, char* argv[]) {
+  aes128ctr_options_t options = AES128CTR_OPTIONS_DEFAULT;
+  shard_plan_t plan;
+  uint64_t    index = 0;
+
+  // Parse any options preceding the positional arguments
+  int code = parse_options(&argc, &argv, &options, "fjn:p:");
+  if (code != 0) return code;
+
+  // Ensure that the minimum number of arguments was provided
+  if (argc < 7) {
+    fprintf(stderr, "error: Not enough arguments.\n");
+    usage(argc, argv);
+    return 1;
+  }
+
+  // Attempt to load the plan held by the first argument
+  if (shard_plan_load(&plan, argv[1]) != 0) {
+    perror("manifest: shard_plan_load()");
+    usage(argc, argv);
+    return 2;
+  }
+  errno = 0;
+  // Attempt to read the SHARD index held by the second argument
+  index = strtoull(argv[2], NULL, 10);
+  if (errno != 0 || index >= plan.count) {
+    fprintf(stderr, "error: shard must be less than %" PRIu64 "\n",
+      plan.count);
+    shard_plan_free(&plan);
+    usage(argc, argv);
+    return 3;
+  }
+
+  // CTR undoes itself, so crypting a shard twice would silently decrypt it
+  const char* manifest = argv[1];
+  const shard_t* shard = plan.shards + index;
+  const int       done = shard_is_done(manifest, shard);
+  const int     active = shard_is_active(manifest, shard);
+  if (!options.force && (done || active)) {
+    fprintf(stderr, "error: shard %" PRIu64 " was already %s (use -f to "
+      "crypt it anyway)\n", index, done ? "completed" :
+      "started and may be partially crypted");
+    shard_plan_free(&plan);
+    return 15;
+  }
+  // Record that the shard is in progress before any of its data is touched
+  if (shard_mark_active(manifest, shard) != 0) {
+    perror("manifest: shard_mark_active()");
+    shard_plan_free(&plan);
+    return 10;
+  }
+
+  // Crypt the shard's range using the remaining arguments
+  argv[2] = plan.file; argv[1] = argv[0];
+  code = crypt_main(argc - 1, argv + 1, &options, shard);
+  if (code == 0) {
+    // Record the shard's completion next to the manifest
+    if (shard_mark_done(manifest, shard) != 0) {
+      perror("manifest: shard_mark_done()");
+      code = 10;
+    }
+  } else if (code != 127) {
+    // Nothing was crypted, so restore the shard's previous state
+    if (done) shard_mark_done(manifest, shard);
+    else if (!active) shard_clear_active(manifest, shard);
+  }
+  shard_plan_free(&plan);
+  return code;
+}
+
+int verify_main(int argc, char* argv[]) {
+  shard_plan_t plan;
+  uint64_t  pending = 0;
+  uint64_t  suspect = 0;
+
+  // Ensure that the minimum number of arguments was provided
+  if (argc < 2) {
+    fprintf(stderr, "error: Not enough arguments.\n");
+    usage(argc, argv);
+    return 1;
+  }
+
+  // Attempt to load the plan held by the first argument
+  if (shard_plan_load(&plan, argv[1]) != 0) {
+    perror("manifest: shard_plan_load()");
+    usage(argc, argv);
+    return 2;
+  }
+  // Report every shard that has not been completed
+  for (uint64_t i = 0; i < plan.count; ++i) {
+    if (shard_is_done(argv[1], plan.shards + i)) continue;
+    if (shard_is_active(argv[1], plan.shards + i)) {
+      // An interrupted shard may be partially crypted and can't just be rerun
+      fprintf(stderr, "suspect: shard %" PRIu64 " (started but not "
+        "completed)\n", i);
+      ++suspect;
+    } else {
+      fprintf(stderr, "pending: shard %" PRIu64 "\n", i);
+      ++pending;
+    }
+  }
+  if (pending > 0 || suspect > 0) {
+    fprintf(stderr, "error: %" PRIu64 " of %" PRIu64 " shards pending, %"
+      PRIu64 " suspect\n", pending, plan.count, suspect);
+    shard_plan_free(&plan);
+    return 127;
+  }
+  fprintf(stderr, "success: All %" PRIu64 " shards complete\n", plan.count);
+  shard_plan_free(&plan);
+  return 0;
+}
+
+int daemon_main(int argc, char* argv[]) {
+  uint64_t  device = 0;
+  uint64_t   limit = 0;
+  aes128ctr_options_t options = AES128CTR_OPTIONS_DEFAULT;
+
+  // Parse any options preceding the positional arguments
+  int code = parse_options(&argc, &argv, &options, "n:p:");
+  if (code != 0) return code;
+  // A single engine serves every request, so it is bound to one node
+  if (options.node_count > 1) {
+    fprintf(stderr, "error: only one node may be given in this mode\n");
+    usage(argc, argv);
+    return 11;
+  }
+
+  // Ensure that the minimum number of arguments was provided
+  if (argc < 4) {
+    fprintf(stderr, "error: Not enough arguments.\n");
+    usage(argc, argv);
+    return 1;
+  }
+
+  errno = 0;
+  // Attempt to read the DEVICE and LIMIT held by the second and third argument
+  device = strtoull(argv[2], NULL, 10);
+  limit  = strtoull(argv[3], NULL, 10);
+  if (errno != 0) {
+    perror("device/limit: strtoull()");
+    usage(argc, argv);
+    return 3;
+  }
+
+  // Bind this thread to the requested NUMA node before allocating anything
+  if (staging_bind(options.node) != 0) {
+    perror("node: staging_bind()");
+    usage(argc, argv);
+    return 13;
+  }
+
+  // Initialize a resident AES128 CTR context (rekeyed for every request)
+  aes128ctr_context_t context;
+  memset(key.val, 0, sizeof(key.val)); aes128_key_init(&key);
+  code = aes128ctr_init_with_options(&context, device, limit,
+    &key, &nonce, &options);
+  if (code != CL_SUCCESS) {
+    fprintf(stderr, "OpenCL error: %d\n", code);
+    usage(argc, argv);
+    return 9;
+  }
+
+  // Serve requests until interrupted
+  fprintf(stderr, "Listening on %s\n", argv[1]);
+  if (aes2d_serve(argv[1], &context) != 0) {
+    perror("socket: aes2d_serve()");
+    code = 15;
+  }
+
+  // Destroy the AES128 CTR context
+  aes128ctr_destroy(&context);
+  return code;
+}
+
+int generate_main(int argc, char* argv[]) {
+  uint64_t  device = 0;
+  uint64_t   limit = 0;
+  uint64_t  length = 0;
+  int           fd = STDOUT_FILENO;
+  unsigned char seed[AES128DRBG_SEED];
+  aes128ctr_options_t options = AES128CTR_OPTIONS_DEFAULT;
+
+  // Parse any options preceding the positional arguments
+  int code = parse_options(&argc, &argv, &options, "n:p:");
+  if (code != 0) return code;
+  // A single engine serves every request, so it is bound to one node
+  if (options.node_count > 1) {
+    fprintf(stderr, "error: only one node may be given in this mode\n");
+    usage(argc, argv);
+    return 11;
+  }
+
+  // Ensure that the minimum number of arguments was provided
+  if (argc < 5) {
+    fprintf(stderr, "error: Not enough arguments.\n");
+    usage(argc, argv);
+    return 1;
+  }
+
+  errno = 0;
+  // Attempt to read the DEVICE, LIMIT and BYTES held by the next arguments
+  device = strtoull(argv[2], NULL, 10);
+  limit  = strtoull(argv[3], NULL, 10);
+  length = strtoull(argv[4], NULL, 10);
+  if (errno != 0) {
+    perror("device/limit/bytes: strtoull()");
+    usage(argc, argv);
+    return 3;
+  }
+
+  // Read the SEED from the optional fifth argument, or from the system
+  if (argc > 5) {
+    if (parse_hex(argv[5], seed, sizeof(seed)) != 0) {
+      fprintf(stderr, "error: seed must be 48 hexadecimal characters\n");
+      usage(argc, argv);
+      return 6;
+    }
+  } else {
+    FILE* rfp = fopen("/dev/urandom", "rb");
+    if (rfp == NULL || fread(seed, 1, sizeof(seed), rfp) != sizeof(seed)) {
+      perror("seed: /dev/urandom");
+      return 6;
+    }
+    fclose(rfp);
+  }
+
+  // Attempt to open the OUTPUT (or use standard output for "-")
+  if (strcmp(argv[1], "-") != 0 &&
+      (fd = open(argv[1], O_WRONLY | O_CREAT, 0644)) < 0) {
+    perror("output: open()");
+    usage(argc, argv);
+    return 10;
+  }
+  // Discard the old contents of a regular file so that no stale tail remains
+  // (devices and pipes are written as-is)
+  struct stat info;
+  if (fd != STDOUT_FILENO && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) &&
+      ftruncate(fd, 0) != 0) {
+    perror("output: ftruncate()");
+    close(fd);
+    usage(argc, argv);
+    return 10;
+  }
+
+  // Bind this thread to the requested NUMA node before allocating anything
+  if (staging_bind(options.node) != 0) {
+    perror("node: staging_bind()");
+    usage(argc, argv);
+    return 13;
+  }
+
+  // Attempt to initialize the generator
+  aes128drbg_t drbg;
+  code = aes128drbg_init(&drbg, device, limit, seed, &options);
+  aes128_wipe(seed, sizeof(seed));
+  if (code != CL_SUCCESS) {
+    fprintf(stderr, "OpenCL error: %d\n", code);
+    usage(argc, argv);
+    return 9;
+  }
+
+  // Stream the requested number of bytes to the output
+  struct timespec start = {0, 0}, end = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t status = 0;
+  code = aes128drbg_fill_fd(&drbg, fd, length, &status);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (code != CL_SUCCESS) fprintf(stderr, "OpenCL error: %d\n", code);
+  else if (status != length) perror("output: write()");
+
+  // Destroy the generator and close the output
+  aes128drbg_destroy(&drbg);
+  if (fd != STDOUT_FILENO) close(fd);
+
+  timespec_diff(&start, &end);
+  double duration = ((double)end.tv_sec + (end.tv_nsec / 1E9f));
+  // Check the status of the generation
+  if (code != CL_SUCCESS || status != length) {
+    fprintf(stderr, "error: Generation failed\n");
+    return 127;
+  }
+  fprintf(stderr, "success: Generated %f MB in %f sec (%f MB/s)\n",
+    (status / (double)(1 << 20)),  duration,
+    (status / (double)(1 << 20)) / duration);
+  return 0;
+}
+
+int selftest_main(int argc, char* argv[]) {
+  uint64_t device = 0;
+  int      failed = 0;
+
+  // Ensure that the minimum number of arguments was provided
+  if (argc < 2) {
+    fprintf(stderr, "error: Not enough arguments.\n");
+    usage(argc, argv);
+    return 1;
+  }
+
+  errno = 0;
+  // Attempt to read the DEVICE held by the first argument
+  device = strtoull(argv[1], NULL, 10);
+  if (errno != 0) {
+    perror("device: strtoull()");
+    usage(argc, argv);
+    return 3;
+  }
+
+  // Compare the bulk key expansion engines against the reference expansion
+  if (selftest_host_keys() != 0) failed = 1;
+  // Check the software engine against published known answers
+  if (selftest_vperm() != 0) failed = 1;
+  cl_int code = selftest_device_keys(device, &failed);
+  if (code != CL_SUCCESS) {
+    fprintf(stderr, "OpenCL error: %d\n", code);
+    return 9;
+  }
+
+  // Check the status of the self-test
+  if (failed) {
+    fprintf(stderr, "error: Self-test failed\n");
+    return 127;
+  }
+  fprintf(stderr, "success: Self-test passed\n");
+  return 0;
+}
+
+void selftest_raw_keys(unsigned char* raw, size_t length) {
+  // Fill the buffer from a fixed xorshift sequence so that runs are repeatable
+  uint64_t state = 0x9E3779B97F4A7C15ULL;
+  for (size_t i = 0; i < length; ++i) {
+    state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+    raw[i] = (unsigned char)state;
+  }
+}
+
+int selftest_host_keys(void) {
+  // An odd count exercises both the grouped and the one-at-a-time paths
+  enum { KEYS = 37 };
+  unsigned char raw[KEYS << 4];
+  aes128_key_t  bulk[KEYS], single[KEYS];
+  selftest_raw_keys(raw, sizeof(raw));
+  for (size_t i = 0; i < KEYS; ++i) {
+    memcpy(  bulk[i].val, raw + (i << 4), 16);
+    memcpy(single[i].val, raw + (i << 4), 16);
+    aes128_key_init(single + i);
+  }
+  aes128_key_init_bulk(bulk, KEYS);
+  int result = memcmp(bulk, single, sizeof(bulk)) == 0 ? 0 : -1;
+  fprintf(stderr, "selftest: host bulk key expansion: %s\n",
+    result == 0 ? "ok" : "FAILED");
+  return result;
+}
+
+int selftest_vperm(void) {
+  // Each vector holds a key, an initial counter block, the plaintext and the
+  // expected ciphertext: FIPS-197 appendix C.1 (as the key stream of the
+  // counter block formed by its plaintext) and SP 800-38A F.5.1
+  static const char* const vectors[][4] = {
+    { "000102030405060708090a0b0c0d0e0f", "00112233445566778899aabbccddeeff",
+      "00000000000000000000000000000000",
+      "69c4e0d86a7b0430d8cdb78070b4c55a" },
+    { "2b7e151628aed2a6abf7158809cf4f3c", "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff",
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+      "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+      "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+      "5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee" },
+  };
+  if (!aes128vperm_supported()) {
+    fprintf(stderr, "selftest: vector-permute engine: skipped (unsupported "
+      "CPU)\n");
+    return 0;
+  }
+  int result = 0;
+  for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i) {
+    aes128vperm_context_t context;
+    aes128_key_t   key;
+    aes128_nonce_t nonce;
+    unsigned char  counter[16], expect[64];
+    aes128_state_t data[4];
+    const size_t   blocks = strlen(vectors[i][2]) >> 5;
+    parse_hex(vectors[i][0], key.val, 16);
+    parse_hex(vectors[i][1], counter, sizeof(counter));
+    parse_hex(vectors[i][2], (unsigned char*)data, blocks << 4);
+    parse_hex(vectors[i][3], expect, blocks << 4);
+    aes128_key_init(&key);
+    // The counter block is the nonce followed by the big-endian block index
+    memcpy(nonce.val, counter, sizeof(nonce.val));
+    aes128vperm_init(&context, &key, &nonce);
+    context.index = 0;
+    for (size_t j = 8; j < 16; ++j)
+      context.index = (context.index << 8) | counter[j];
+    if (aes128vperm_crypt_blocks(&context, data, blocks) != blocks ||
+        memcmp(data, expect, blocks << 4) != 0) result = -1;
+    aes128vperm_destroy(&context);
+  }
+  fprintf(stderr, "selftest: vector-permute engine: %s\n",
+    result == 0 ? "ok" : "FAILED");
+  return result;
+}
+
+cl_int selftest_device_keys(uint64_t device, int* failed) {
+  enum { KEYS = 37, BLOCKS = 4 };
+  unsigned char  raw[KEYS << 4];
+  aes128_key_t   key;
+  aes128_nonce_t nonce = { { 0 } };
+  aes128_state_t expect[BLOCKS], actual[BLOCKS];
+  aes128ctr_context_t context;
+  cl_mem         schedules = NULL;
+  int             mismatch = 0;
+  selftest_raw_keys(raw, sizeof(raw));
+  // Attempt to initialize an AES128 CTR context on the requested device
+  memcpy(key.val, raw, 16);
+  aes128_key_init(&key);
+  cl_int status = aes128ctr_init(&context, device, BLOCKS, &key, &nonce);
+  if (status != CL_SUCCESS) return status;
+  // Expand every key on the device at once
+  status = aes128ctr_expand_keys(&context, raw, KEYS, &schedules);
+  // Each device-expanded schedule must produce the same key stream as the
+  // host-expanded one
+  for (size_t i = 0; status == CL_SUCCESS && i < KEYS; ++i) {
+    memcpy(key.val, raw + (i << 4), 16);
+    aes128_key_init(&key);
+    status = aes128ctr_rekey(&context, &key, &nonce);
+    if (status == CL_SUCCESS &&
+        aes128ctr_keystream_blocks(&context, expect, BLOCKS) != BLOCKS)
+      status = CL_INVALID_OPERATION;
+    if (status == CL_SUCCESS)
+      status = aes128ctr_select_key(&context, schedules, i, &nonce);
+    if (status == CL_SUCCESS &&
+        aes128ctr_keystream_blocks(&context, actual, BLOCKS) != BLOCKS)
+      status = CL_INVALID_OPERATION;
+    if (status == CL_SUCCESS && memcmp(expect, actual, sizeof(expect)) != 0)
+      mismatch = 1;
+  }
+  if (schedules != NULL) aes128ctr_release_keys(&context, schedules, KEYS);
+  aes128ctr_destroy(&context);
+  aes128_wipe(key.val, sizeof(key.val));
+  if (status != CL_SUCCESS) return status;
+  fprintf(stderr, "selftest: device key expansion: %s\n",
+    mismatch ? "FAILED" : "ok");
+  if (mismatch) (*failed) = 1;
+  return CL_SUCCESS;
+}
+
+int parse_hex(const char* str, unsigned char* out, const size_t length) {
+  // Ensure that the string holds exactly two digits per output byte (with no
+  // sign, whitespace or "0x" prefix)
+  if (strlen(str) != length << 1) return -1;
+  for (size_t i = 0; i < length << 1; ++i)
+    if (!isxdigit((unsigned char)str[i])) return -1;
+  for (size_t i = 0; i < length; ++i) {
+    char digits[3] = { str[i << 1], str[(i << 1) + 1], 0 };
+    out[i] = (unsigned char)strtoul(digits, NULL, 16);
+  }
+  return 0;
+}
+
+int parse_options(int* argc, char** argv[], aes128ctr_options_t* options,
+    const char* flags) {
+  // Parse any options preceding the positional arguments (only those in
+  // `flags` are accepted, so each subcommand rejects the ones it ignores)
+  for (int opt = 0; (opt = getopt(*argc, *argv, flags)) != -1; ) {
+    if (opt == 'f') {
+      // Crypt a shard even if it was already started or completed
+      options->force = 1;
+    } else if (opt == 'j') {
+      // Bake the key into a specialized kernel built at runtime
+      options->jit = 1;
+    } else if (opt == 'n') {
+      // Attempt to read the NUMA node (or comma-separated nodes) to bind to
+      char* str = optarg;
+      int valid = 0;
+      options->node_count = 0;
+      while (!valid && options->node_count < AES128CTR_MAX_NODES) {
+        char* end = NULL;
+        errno = 0;
+        // Every element must be a plain decimal number (none may be empty)
+        long value = isdigit((unsigned char)*str) ? strtol(str, &end, 10) : -1;
+        if (errno != 0 || value < 0 || value > INT_MAX) break;
+        options->nodes[options->node_count++] = (int)value;
+        if (*end == 0) valid = 1;
+        else if (*end != ',') break;
+        str = end + 1;
+      }
+      if (!valid) {
+        fprintf(stderr, "error: node must be a non-negative integer (or a "
+          "list of at most %d)\n", AES128CTR_MAX_NODES);
+        usage(*argc, *argv);
+        return 11;
+      }
+      options->node = options->nodes[0];
+    } else if (opt == 'p') {
+      // Attempt to read the page size used for staging memory
+      if (staging_parse_pages(optarg, &options->pages) != 0) {
+        fprintf(stderr, "error: pages must be one of 4k, thp, 2m or 1g\n");
+        usage(*argc, *argv);
+        return 12;
+      }
+    } else if (opt == 'z') {
+      // Map streamed output into a pipe with vmsplice() instead of copying
+      options->zerocopy = 1;
+    } else {
+      usage(*argc, *argv);
+      return 1;
+    }
+  }
+  // Shift the positional arguments so that the first one is at index one
+  (*argv)[optind - 1] = (*argv)[0]; (*argc) -= optind - 1; (*argv) += optind - 1;
+  return 0;
+}
+
 void print_devices() {
   // Allocate storage space for required variables
   unsigned long valueSize =    0;
@@ -247,13 +1163,42 @@ void timespec_diff(const struct timespec* start, struct timespec* end) {
 void usage(int argc, char* argv[]) {
   if (argc > 0) {
     print_devices();
-    fprintf(stderr, "\nUsage: %s <file> <device> <limit> <key> "
-      "<nonce>\n", argv[0]);
-    fprintf(stderr, "  * file   is a file path to in-place (de|en)crypt\n"
+    fprintf(stderr, "\nUsage: %s [-j] [-n <node>] [-p <pages>] [-z] <file> "
+      "<device> <limit> <key> <nonce>\n", argv[0]);
+    fprintf(stderr, "       %s daemon [-n <node>] [-p <pages>] <socket> "
+      "<device> <limit>\n", argv[0]);
+    fprintf(stderr, "       %s generate [-n <node>] [-p <pages>] <output> "
+      "<device> <limit> <bytes> [<seed>]\n", argv[0]);
+    fprintf(stderr, "       %s plan <file> <shards> <manifest>\n", argv[0]);
+    fprintf(stderr, "       %s selftest <device>\n", argv[0]);
+    fprintf(stderr, "       %s shard [-f] [-j] [-n <node>] [-p <pages>] "
+      "<manifest> <index> <device> <limit> <key> <nonce>\n", argv[0]);
+    fprintf(stderr, "       %s verify <manifest>\n", argv[0]);
+    fprintf(stderr, "  * -f     crypts a shard that was already started or "
+                    "completed\n"
+                    "  * -j     bakes the key into a runtime-built kernel\n"
+                    "  * node   is a NUMA node to bind memory and threads to "
+                    "(or a comma-\n"
+                    "           separated list to split a file across, with "
+                    "an engine per node)\n"
+                    "  * pages  is the staging page size (4k, thp, 2m, 1g)\n"
+                    "  * -z     maps streamed output into a pipe (only safe "
+                    "if its reader\n"
+                    "           does not splice() the data any further)\n"
+                    "  * socket is a path at which to serve requests\n"
+                    "  * output is a file path to fill (or - for stdout)\n"
+                    "  * file   is a file path to in-place (de|en)crypt (or - "
+                    "to crypt\n"
+                    "           stdin to stdout)\n"
+                    "  * shards is the number of shards to split a file into\n"
+                    "  * index  is the zero-index of a shard from a manifest\n"
                     "  * device is a numeric index from above\n"
                     "  * limit  is a maximum number of kernels\n"
                     "  * key    is a 128-bit hexadecimal value\n"
-                    "  * nonce  is a  64-bit hexadecimal value\n");
+                    "  * nonce  is a  64-bit hexadecimal value\n"
+                    "  * bytes  is the number of random bytes to generate\n"
+                    "  * seed   is a 192-bit hexadecimal value (default: "
+                    "/dev/urandom)\n");
   } else {
     fprintf(stderr, "error: argc <= 0\n");
   }
@@ -0,0 +1,316 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes2.
+ *
+ * clayfreeman/aes2 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes2; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "shard.h"
+
+#define SHARD_HEADER "# aes2 shard manifest v1"
+
+/**
+ * Splits a file into a number of shards that can be crypted independently.
+ *
+ * Each shard starts on a block boundary, and its counter is the index of its
+ * first block, so crypting every shard yields exactly the same output as
+ * crypting the whole file at once.
+ *
+ * @param   plan   An output parameter used to store the plan.
+ * @param   file   The path of the file to be split.
+ * @param   count  The desired number of shards (fewer are planned if the file
+ *                 has fewer blocks).
+ *
+ * @return         0 on success, or -1 on failure (with `errno` set).
+ */
+int shard_plan_create(shard_plan_t* const plan, const char* file,
+    const uint64_t count) {
+  struct stat st;
+  // Zero-initialize the structure before first use
+  memset(plan, 0, sizeof(*plan));
+  if (count == 0)            { errno = EINVAL; return -1; }
+  if (stat(file, &st) != 0)  return -1;
+  // Spread the blocks of the file as evenly as possible
+  uint64_t blocks = ((uint64_t)st.st_size + 15) >> 4;
+  uint64_t   each = (blocks + count - 1) / count;
+  plan->size  = (uint64_t)st.st_size;
+  plan->count = each > 0 ? (blocks + each - 1) / each : 1;
+  // Store an absolute path so the plan works from any directory or node
+  if ((plan->file = realpath(file, NULL)) == NULL) return -1;
+  plan->shards = (shard_t*)calloc(plan->count, sizeof(shard_t));
+  if (plan->file == NULL || plan->shards == NULL) {
+    shard_plan_free(plan); errno = ENOMEM; return -1;
+  }
+  for (uint64_t i = 0; i < plan->count; ++i) {
+    shard_t* shard = plan->shards + i;
+    shard->index   = i;
+    shard->counter = i * each;
+    shard->offset  = shard->counter << 4;
+    shard->length  = plan->size - shard->offset < (each << 4) ?
+      plan->size - shard->offset : (each << 4);
+  }
+  return 0;
+}
+
+/**
+ * Writes a plan to a manifest file.
+ *
+ * @param   plan      The plan to be written.
+ * @param   manifest  The path of the manifest.
+ *
+ * @return            0 on success, or -1 on failure (with `errno` set).
+ */
+int shard_plan_save(const shard_plan_t* const plan, const char* manifest) {
+  FILE* fp = fopen(manifest, "w");
+  if (fp == NULL) return -1;
+  fprintf(fp, SHARD_HEADER "\n");
+  fprintf(fp, "size %" PRIu64 "\n",   plan->size);
+  fprintf(fp, "shards %" PRIu64 "\n", plan->count);
+  for (uint64_t i = 0; i < plan->count; ++i)
+    fprintf(fp, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+      plan->shards[i].index,  plan->shards[i].offset,
+      plan->shards[i].length, plan->shards[i].counter);
+  // The path goes last so that it may contain any character but a newline
+  fprintf(fp, "file %s\n", plan->file);
+  if (ferror(fp) | fclose(fp)) return -1;
+  return 0;
+}
+
+/**
+ * Reads a plan from a manifest file.
+ *
+ * @param   plan      An output parameter used to store the plan.
+ * @param   manifest  The path of the manifest.
+ *
+ * @return            0 on success, or -1 on failure (with `errno` set).
+ */
+int shard_plan_load(shard_plan_t* const plan, const char* manifest) {
+  char line[4096];
+  FILE* fp = NULL;
+  // Zero-initialize the structure before first use
+  memset(plan, 0, sizeof(*plan));
+  if ((fp = fopen(manifest, "r")) == NULL) return -1;
+  // Read the header, the file size and the number of shards
+  if (fgets(line, sizeof(line), fp) == NULL ||
+      strncmp(line, SHARD_HEADER, strlen(SHARD_HEADER)) != 0 ||
+      fscanf(fp, "size %" SCNu64 " shards %" SCNu64 " ",
+        &plan->size, &plan->count) != 2 || plan->count == 0 ||
+      (plan->shards = (shard_t*)calloc(plan->count, sizeof(shard_t))) == NULL)
+    goto invalid;
+  // Read each shard, which must be listed in order and must start where the
+  // previous one ended (only an empty file may have an empty shard)
+  uint64_t end = 0;
+  for (uint64_t i = 0; i < plan->count; ++i) {
+    shard_t* shard = plan->shards + i;
+    if (fscanf(fp, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " ",
+          &shard->index, &shard->offset, &shard->length,
+          &shard->counter) != 4 || shard->index != i ||
+        (shard->offset & 15) != 0 || shard->counter != shard->offset >> 4 ||
+        shard->offset != end || shard->length > plan->size - end ||
+        (shard->length == 0 && plan->size != 0))
+      goto invalid;
+    end += shard->length;
+  }
+  // The shards must cover the whole file
+  if (end != plan->size) goto invalid;
+  // Read the path of the file, which `shard_plan_create()` made absolute
+  if (fgets(line, sizeof(line), fp) == NULL ||
+      strncmp(line, "file /", 6) != 0) goto invalid;
+  line[strcspn(line, "\n")] = 0;
+  if ((plan->file = strdup(line + 5)) == NULL) goto invalid;
+  fclose(fp);
+  return 0;
+invalid:
+  fclose(fp);
+  shard_plan_free(plan);
+  errno = EINVAL;
+  return -1;
+}
+
+/**
+ * Release all memory used by a plan.
+ *
+ * @param  plan  The plan to be freed.
+ */
+void shard_plan_free(shard_plan_t* const plan) {
+  free(plan->file);
+  free(plan->shards);
+  memset(plan, 0, sizeof(*plan));
+}
+
+/**
+ * Formats the path of one of a shard's markers (`<manifest>.<index>.<kind>`).
+ *
+ * @param   path      An output buffer for the path.
+ * @param   size      The size of the output buffer.
+ * @param   manifest  The path of the manifest.
+ * @param   shard     The shard whose marker path is needed.
+ * @param   kind      The kind of marker (`active` or `done`).
+ *
+ * @return            0 on success, or -1 if the path is too long.
+ */
+int shard_marker(char* path, const size_t size, const char* manifest,
+    const shard_t* const shard, const char* kind) {
+  int length = snprintf(path, size, "%s.%" PRIu64 ".%s", manifest,
+    shard->index, kind);
+  if (length < 0 || (size_t)length >= size) { errno = ENAMETOOLONG; return -1; }
+  return 0;
+}
+
+/**
+ * Durably writes one of a shard's markers next to the manifest. The marker
+ * repeats the shard's range so that a stale marker from a different plan is
+ * not mistaken for this shard's.
+ *
+ * @param   manifest  The path of the manifest.
+ * @param   shard     The shard to be marked.
+ * @param   kind      The kind of marker (`active` or `done`).
+ *
+ * @return            0 on success, or -1 on failure (with `errno` set).
+ */
+int shard_write_marker(const char* manifest, const shard_t* const shard,
+    const char* kind) {
+  char path[4096];
+  if (shard_marker(path, sizeof(path), manifest, shard, kind) != 0) return -1;
+  FILE* fp = fopen(path, "w");
+  if (fp == NULL) return -1;
+  fprintf(fp, "%" PRIu64 " %" PRIu64 "\n", shard->offset, shard->length);
+  // Flush the marker to disk so that it survives a crash
+  if (ferror(fp) | fflush(fp) | fsync(fileno(fp))) { fclose(fp); return -1; }
+  if (fclose(fp) != 0) return -1;
+  return 0;
+}
+
+/**
+ * Removes one of a shard's markers (if it exists).
+ *
+ * @param   manifest  The path of the manifest.
+ * @param   shard     The shard whose marker should be removed.
+ * @param   kind      The kind of marker (`active` or `done`).
+ *
+ * @return            0 on success, or -1 on failure (with `errno` set).
+ */
+int shard_remove_marker(const char* manifest, const shard_t* const shard,
+    const char* kind) {
+  char path[4096];
+  if (shard_marker(path, sizeof(path), manifest, shard, kind) != 0) return -1;
+  if (unlink(path) != 0 && errno != ENOENT) return -1;
+  return 0;
+}
+
+/**
+ * Checks whether one of a shard's markers exists and matches its range.
+ *
+ * @param   manifest  The path of the manifest.
+ * @param   shard     The shard to be checked.
+ * @param   kind      The kind of marker (`active` or `done`).
+ *
+ * @return            1 if the marker matches, otherwise 0.
+ */
+int shard_has_marker(const char* manifest, const shard_t* const shard,
+    const char* kind) {
+  char     path[4096];
+  uint64_t offset = 0, length = 0;
+  if (shard_marker(path, sizeof(path), manifest, shard, kind) != 0) return 0;
+  FILE* fp = fopen(path, "r");
+  if (fp == NULL) return 0;
+  int matched = fscanf(fp, "%" SCNu64 " %" SCNu64, &offset, &length) == 2 &&
+    offset == shard->offset && length == shard->length;
+  fclose(fp);
+  return matched;
+}
+
+/**
+ * Records that a shard is about to be crypted, before any of its data is
+ * touched. A shard whose run is interrupted keeps this marker, so it can be
+ * told apart from one that was never started. Any previous completion
+ * marker is removed since the shard's data is about to change again.
+ *
+ * @param   manifest  The path of the manifest.
+ * @param   shard     The shard that is being started.
+ *
+ * @return            0 on success, or -1 on failure (with `errno` set).
+ */
+int shard_mark_active(const char* manifest, const shard_t* const shard) {
+  if (shard_write_marker(manifest, shard, "active") != 0) return -1;
+  return shard_remove_marker(manifest, shard, "done");
+}
+
+/**
+ * Removes a shard's in-progress marker, for runs that failed before any of
+ * the shard's data was touched.
+ *
+ * @param   manifest  The path of the manifest.
+ * @param   shard     The shard that was not started after all.
+ *
+ * @return            0 on success, or -1 on failure (with `errno` set).
+ */
+int shard_clear_active(const char* manifest, const shard_t* const shard) {
+  return shard_remove_marker(manifest, shard, "active");
+}
+
+/**
+ * Checks whether a shard was started but never completed (so that its data
+ * may be only partially crypted).
+ *
+ * @param   manifest  The path of the manifest.
+ * @param   shard     The shard to be checked.
+ *
+ * @return            1 if the shard is in progress or was interrupted,
+ *                    otherwise 0.
+ */
+int shard_is_active(const char* manifest, const shard_t* const shard) {
+  return !shard_is_done(manifest, shard) &&
+    shard_has_marker(manifest, shard, "active");
+}
+
+/**
+ * Records that a shard has been crypted by writing its completion marker and
+ * then removing its in-progress marker.
+ *
+ * @param   manifest  The path of the manifest.
+ * @param   shard     The shard that was completed.
+ *
+ * @return            0 on success, or -1 on failure (with `errno` set).
+ */
+int shard_mark_done(const char* manifest, const shard_t* const shard) {
+  if (shard_write_marker(manifest, shard, "done") != 0) return -1;
+  return shard_remove_marker(manifest, shard, "active");
+}
+
+/**
+ * Checks whether a shard's completion marker exists and matches its range.
+ *
+ * @param   manifest  The path of the manifest.
+ * @param   shard     The shard to be checked.
+ *
+ * @return            1 if the shard is complete, otherwise 0.
+ */
+int shard_is_done(const char* manifest, const shard_t* const shard) {
+  return shard_has_marker(manifest, shard, "done");
+}
@@ -0,0 +1,60 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes2.
+ *
+ * clayfreeman/aes2 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes2; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SHARD_H
+#define __SHARD_H
+
+#include <stdint.h>
+
+typedef struct {
+  uint64_t         index; // The zero-index of this shard
+  uint64_t        offset; // The byte offset of the shard (block-aligned)
+  uint64_t        length; // The number of bytes in the shard
+  uint64_t       counter; // The block index of the shard's first block
+} shard_t;
+
+typedef struct {
+  char*             file; // The path of the file being crypted
+  uint64_t          size; // The size of the file in bytes
+  uint64_t         count; // The number of shards
+  shard_t*        shards; // The shards covering the file, in order
+} shard_plan_t;
+
+extern int shard_plan_create(shard_plan_t* const plan, const char* file,
+  const uint64_t count);
+
+extern int shard_plan_save(const shard_plan_t* const plan,
+  const char* manifest);
+
+extern int shard_plan_load(shard_plan_t* const plan, const char* manifest);
+
+extern void shard_plan_free(shard_plan_t* const plan);
+
+extern int shard_mark_active(const char* manifest, const shard_t* const shard);
+
+extern int shard_clear_active(const char* manifest,
+  const shard_t* const shard);
+
+extern int shard_is_active(const char* manifest, const shard_t* const shard);
+
+extern int shard_mark_done(const char* manifest, const shard_t* const shard);
+
+extern int shard_is_done(const char* manifest, const shard_t* const shard);
+
+#endif
@@ -0,0 +1,180 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes2.
+ *
+ * clayfreeman/aes2 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes2; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+  #include <sys/mman.h>
+#endif
+
+#ifdef AES2_NUMA
+  #include <numa.h>
+#endif
+
+#include "staging.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#define STAGING_PAGE (4096UL)
+#define STAGING_2M   (2UL << 20)
+#define STAGING_1G   (1UL << 30)
+
+/**
+ * Rounds a size up to the nearest multiple of a power-of-two page size.
+ *
+ * @param   size  The size to be rounded.
+ * @param   page  The page size (must be a power of two).
+ *
+ * @return        The rounded size.
+ */
+size_t staging_round(const size_t size, const size_t page) {
+  return (size + page - 1) & ~(page - 1);
+}
+
+/**
+ * Allocates a page-aligned staging buffer, optionally backed by huge pages and
+ * bound to a specific NUMA node.
+ *
+ * The buffer is faulted in before returning so that its pages are placed on
+ * the requested node rather than on whichever node first touches it later.
+ *
+ * @param   stage  An output parameter used to store the buffer.
+ * @param   size   The minimum size of the buffer.
+ * @param   node   The NUMA node to hold the buffer, or -1 for any node.
+ * @param   pages  The page size used to back the buffer.
+ *
+ * @return         0 on success, or -1 on failure (with `errno` set).
+ */
+int staging_alloc(staging_t* const stage, const size_t size,
+    const int node, const staging_pages_t pages) {
+  // Zero-initialize the structure before first use
+  memset(stage, 0, sizeof(*stage));
+  #ifndef AES2_NUMA
+  // NUMA placement is unavailable without libnuma
+  if (node >= 0) { errno = ENOSYS; return -1; }
+  #endif
+  #ifdef __linux__
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  // Determine the mapping length and flags for the requested page size
+  switch (pages) {
+    case STAGING_PAGES_2M:
+      stage->size = staging_round(size, STAGING_2M);
+      flags      |= MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+      break;
+    case STAGING_PAGES_1G:
+      stage->size = staging_round(size, STAGING_1G);
+      flags      |= MAP_HUGETLB | (30 << MAP_HUGE_SHIFT);
+      break;
+    case STAGING_PAGES_THP:
+      stage->size = staging_round(size, STAGING_2M);
+      break;
+    default:
+      stage->size = staging_round(size, STAGING_PAGE);
+      break;
+  }
+  // Attempt to map the buffer without faulting in any of its pages
+  stage->ptr = mmap(NULL, stage->size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (stage->ptr == MAP_FAILED) { stage->ptr = NULL; return -1; }
+  stage->mapped = 1;
+  // Ask for transparent huge pages if requested (this is only advisory)
+  if (pages == STAGING_PAGES_THP)
+    madvise(stage->ptr, stage->size, MADV_HUGEPAGE);
+  #else
+  // Huge pages are only supported on Linux
+  if (pages != STAGING_PAGES_DEFAULT) { errno = ENOTSUP; return -1; }
+  stage->size = staging_round(size, STAGING_PAGE);
+  if ((errno = posix_memalign(&stage->ptr, STAGING_PAGE, stage->size)) != 0) {
+    stage->ptr = NULL; return -1;
+  }
+  #endif
+  #ifdef AES2_NUMA
+  // Bind the buffer's pages to the requested node before they are touched
+  if (node >= 0) {
+    if (numa_available() < 0 || node > numa_max_node()) {
+      staging_free(stage); errno = EINVAL; return -1;
+    }
+    numa_tonode_memory(stage->ptr, stage->size, node);
+  }
+  #endif
+  // Fault in every page now so that placement happens up front
+  memset(stage->ptr, 0, stage->size);
+  return 0;
+}
+
+/**
+ * Release all memory used by a staging buffer.
+ *
+ * @param  stage  The staging buffer to be freed.
+ */
+void staging_free(staging_t* const stage) {
+  if (stage->ptr != NULL) {
+    #ifdef __linux__
+    if (stage->mapped) munmap(stage->ptr, stage->size);
+    #else
+    free(stage->ptr);
+    #endif
+  }
+  memset(stage, 0, sizeof(*stage));
+}
+
+/**
+ * Binds the calling thread (and its future allocations) to a NUMA node.
+ *
+ * @param   node  The NUMA node to bind to, or -1 to leave the thread unbound.
+ *
+ * @return        0 on success, or -1 on failure (with `errno` set).
+ */
+int staging_bind(const int node) {
+  if (node < 0) return 0;
+  #ifdef AES2_NUMA
+  if (numa_available() < 0 || node > numa_max_node()) {
+    errno = EINVAL; return -1;
+  }
+  // Run only on the CPUs of this node and prefer its memory
+  if (numa_run_on_node(node) != 0) return -1;
+  numa_set_preferred(node);
+  return 0;
+  #else
+  errno = ENOSYS;
+  return -1;
+  #endif
+}
+
+/**
+ * Parses a page size name (`4k`, `thp`, `2m` or `1g`).
+ *
+ * @param   str    The page size name to parse.
+ * @param   pages  An output parameter used to store the page size.
+ *
+ * @return         0 on success, or -1 if the name is not recognized.
+ */
+int staging_parse_pages(const char* str, staging_pages_t* pages) {
+  if      (strcmp(str, "4k" ) == 0) (*pages) = STAGING_PAGES_DEFAULT;
+  else if (strcmp(str, "thp") == 0) (*pages) = STAGING_PAGES_THP;
+  else if (strcmp(str, "2m" ) == 0) (*pages) = STAGING_PAGES_2M;
+  else if (strcmp(str, "1g" ) == 0) (*pages) = STAGING_PAGES_1G;
+  else return -1;
+  return 0;
+}
@@ -0,0 +1,50 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes2.
+ *
+ * clayfreeman/aes2 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes2; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STAGING_H
+#define __STAGING_H
+
+#include <stddef.h>
+
+/**
+ * The page size used to back a staging buffer.
+ */
+typedef enum {
+  STAGING_PAGES_DEFAULT = 0, // Regular pages from the system
+  STAGING_PAGES_THP,         // Transparent huge pages (best effort)
+  STAGING_PAGES_2M,          // Explicit 2 MiB huge pages (`MAP_HUGETLB`)
+  STAGING_PAGES_1G           // Explicit 1 GiB huge pages (`MAP_HUGETLB`)
+} staging_pages_t;
+
+typedef struct {
+  void*            ptr; // The page-aligned base address of the buffer
+  size_t          size; // The length of the buffer rounded to its page size
+  int           mapped; // Whether the buffer was created using `mmap()`
+} staging_t;
+
+extern int staging_alloc(staging_t* const stage, const size_t size,
+  const int node, const staging_pages_t pages);
+
+extern void staging_free(staging_t* const stage);
+
+extern int staging_bind(const int node);
+
+extern int staging_parse_pages(const char* str, staging_pages_t* pages);
+
+#endif